@@ -10,6 +10,7 @@ expr
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
     | CELL  # Cell
+    | REF_ERROR  # RefError
     | NUMBER  # Literal
     ;
 
@@ -27,4 +28,6 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// a reference to a deleted cell, as printed after rows or columns are deleted
+REF_ERROR: '#REF!' ;
 WS: [ \t\n\r]+ -> skip ;
@@ -4,8 +4,8 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
-#include <charconv>
 #include <cmath>
 #include <memory>
 #include <optional>
@@ -73,7 +73,9 @@ public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(std::function<CellInterface::Value(Position)>& cell_value_getter) const = 0;
+    virtual double Evaluate(std::function<CellInterface::ValueView(Position)>& cell_value_getter) const = 0;
+    // appends the postfix instructions of the subtree to the program
+    virtual void Compile(FormulaProgram& program) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
@@ -143,7 +145,7 @@ public:
         }
     }
 
-    double Evaluate(std::function<CellInterface::Value(Position)>& cell_value_getter) const override {
+    double Evaluate(std::function<CellInterface::ValueView(Position)>& cell_value_getter) const override {
         double lhs = lhs_->Evaluate(cell_value_getter);
         double rhs = rhs_->Evaluate(cell_value_getter);
         
@@ -155,8 +157,7 @@ public:
         } else if (type_ == Multiply) {
             result = lhs * rhs;
         } else { // type_ == Divide
-            constexpr double epsilon = 1.e-30;
-            if (std::abs(rhs) < epsilon) {
+            if (std::abs(rhs) < DIVISION_EPSILON) {
                 throw FormulaError(FormulaError::Category::Arithmetic);
             }
             result = lhs / rhs;
@@ -167,6 +168,23 @@ public:
         return result;
     }
 
+    void Compile(FormulaProgram& program) const override {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
+
+        FormulaInstruction instruction;
+        if (type_ == Add) {
+            instruction.code = FormulaInstruction::Code::Add;
+        } else if (type_ == Subtract) {
+            instruction.code = FormulaInstruction::Code::Subtract;
+        } else if (type_ == Multiply) {
+            instruction.code = FormulaInstruction::Code::Multiply;
+        } else { // type_ == Divide
+            instruction.code = FormulaInstruction::Code::Divide;
+        }
+        program.push_back(instruction);
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> lhs_;
@@ -201,7 +219,7 @@ public:
         return EP_UNARY;
     }
 
-    double Evaluate(std::function<CellInterface::Value(Position)>& cell_value_getter) const override {
+    double Evaluate(std::function<CellInterface::ValueView(Position)>& cell_value_getter) const override {
         double result = operand_->Evaluate(cell_value_getter);
         if (type_ == UnaryPlus) {
             return result;
@@ -210,6 +228,17 @@ public:
         }
     }
 
+    void Compile(FormulaProgram& program) const override {
+        operand_->Compile(program);
+        FormulaInstruction instruction;
+        if (type_ == UnaryMinus) {
+            instruction.code = FormulaInstruction::Code::Negate;
+        } else { // type_ == UnaryPlus
+            instruction.code = FormulaInstruction::Code::Plus;
+        }
+        program.push_back(instruction);
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
@@ -237,30 +266,26 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(std::function<CellInterface::Value(Position)>& cell_value_getter) const override {
+    double Evaluate(std::function<CellInterface::ValueView(Position)>& cell_value_getter) const override {
         if (!cell_->IsValid()) {
             throw FormulaError(FormulaError::Category::Ref);
         }
-        CellInterface::Value value = cell_value_getter(*cell_);
+        auto argument = ToFormulaArgument(cell_value_getter(*cell_));
+        if (std::holds_alternative<FormulaError>(argument)) {
+            throw std::get<FormulaError>(argument);
+        }
+        return std::get<double>(argument);
+    }
 
-        // Если значение ячейки является строкой, попытаться привести к double
-        if (std::holds_alternative<std::string>(value)) {
-            std::string str = std::get<std::string>(value);
-            if (str.empty()) {
-                return 0.0;
-            }
-            double numeric_value = 0.0;
-            auto result = std::from_chars(str.data(), str.data() + str.size(), numeric_value);
-            if (result.ec == std::errc() && result.ptr == str.data() + str.size()) {
-                return numeric_value;
-            } else {
-                throw FormulaError(FormulaError::Category::Value);
-            }
-        } else if (std::holds_alternative<FormulaError>(value)) {
-            throw std::get<FormulaError>(value);
+    void Compile(FormulaProgram& program) const override {
+        FormulaInstruction instruction;
+        if (!cell_->IsValid()) {
+            instruction.code = FormulaInstruction::Code::RefError;
         } else {
-            return std::get<double>(value);
+            instruction.code = FormulaInstruction::Code::Cell;
+            instruction.cell = *cell_;
         }
+        program.push_back(instruction);
     }
 
 private:
@@ -285,10 +310,17 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(std::function<CellInterface::Value(Position)>& /*cell_value_getter*/) const override {
+    double Evaluate(std::function<CellInterface::ValueView(Position)>& /*cell_value_getter*/) const override {
         return value_;
     }
 
+    void Compile(FormulaProgram& program) const override {
+        FormulaInstruction instruction;
+        instruction.code = FormulaInstruction::Code::Number;
+        instruction.number = value_;
+        program.push_back(instruction);
+    }
+
 private:
     double value_;
 };
@@ -350,6 +382,11 @@ public:
         args_.push_back(std::move(node));
     }
 
+    void exitRefError(FormulaParser::RefErrorContext* /* ctx */) override {
+        // an invalid position is printed and evaluated as #REF!
+        args_.push_back(std::make_unique<CellExpr>(&Position::NONE));
+    }
+
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
@@ -431,6 +468,73 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
     return ParseFormulaAST(in);
 }
 
+FormulaAST BuildFormulaAST(const FormulaProgram& program) {
+    using namespace ASTImpl;
+    using Code = FormulaInstruction::Code;
+
+    std::vector<std::unique_ptr<Expr>> args;
+    std::forward_list<Position> cells;
+    auto pop_arg = [&args]() {
+        if (args.empty()) {
+            throw FormulaException("Invalid formula program: missing operand");
+        }
+        auto arg = std::move(args.back());
+        args.pop_back();
+        return arg;
+    };
+
+    for (const FormulaInstruction& instruction : program) {
+        switch (instruction.code) {
+            case Code::Number:
+                args.push_back(std::make_unique<NumberExpr>(instruction.number));
+                break;
+            case Code::Cell:
+                if (!instruction.cell.IsValid()) {
+                    throw FormulaException("Invalid position: " + instruction.cell.ToString());
+                }
+                cells.push_front(instruction.cell);
+                args.push_back(std::make_unique<CellExpr>(&cells.front()));
+                break;
+            case Code::RefError:
+                // an invalid position is printed and evaluated as #REF!
+                args.push_back(std::make_unique<CellExpr>(&Position::NONE));
+                break;
+            case Code::Negate:
+            case Code::Plus: {
+                auto type = instruction.code == Code::Negate ? UnaryOpExpr::UnaryMinus
+                                                             : UnaryOpExpr::UnaryPlus;
+                auto operand = pop_arg();
+                args.push_back(std::make_unique<UnaryOpExpr>(type, std::move(operand)));
+                break;
+            }
+            case Code::Add:
+            case Code::Subtract:
+            case Code::Multiply:
+            case Code::Divide: {
+                BinaryOpExpr::Type type = BinaryOpExpr::Add;
+                if (instruction.code == Code::Subtract) {
+                    type = BinaryOpExpr::Subtract;
+                } else if (instruction.code == Code::Multiply) {
+                    type = BinaryOpExpr::Multiply;
+                } else if (instruction.code == Code::Divide) {
+                    type = BinaryOpExpr::Divide;
+                }
+                auto rhs = pop_arg();
+                auto lhs = pop_arg();
+                args.push_back(std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs)));
+                break;
+            }
+            default:
+                throw FormulaException("Invalid formula program: unknown instruction");
+        }
+    }
+
+    if (args.size() != 1) {
+        throw FormulaException("Invalid formula program: unbalanced stack");
+    }
+    return FormulaAST(std::move(args.front()), std::move(cells));
+}
+
 void FormulaAST::PrintCells(std::ostream& out) const {
     for (auto cell : cells_) {
         out << cell.ToString() << ' ';
@@ -445,7 +549,7 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(std::function<CellInterface::Value(Position)>& cell_value_getter) const {
+double FormulaAST::Execute(std::function<CellInterface::ValueView(Position)>& cell_value_getter) const {
     return root_expr_->Evaluate(cell_value_getter);
 }
 
@@ -453,6 +557,37 @@ FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_li
     : root_expr_(std::move(root_expr))
     , cells_(std::move(cells)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    Rebuild();
+}
+
+void FormulaAST::UpdateReferences(const std::function<Position(Position)>& update) {
+    for (Position& cell : cells_) {
+        if (cell.IsValid()) {
+            cell = update(cell);
+            if (!cell.IsValid()) {
+                cell = Position::NONE;
+            }
+        }
+    }
+    // the nodes are relinked, not moved, so CellExpr pointers stay valid
+    cells_.sort();
+    Rebuild();
+}
+
+void FormulaAST::Rebuild() {
+    // #REF! references are kept in cells_ for the AST but are not referenced
+    referenced_cells_.clear();
+    for (Position cell : cells_) {
+        if (cell.IsValid()) {
+            referenced_cells_.push_back(cell);
+        }
+    }
+    referenced_cells_.erase(std::unique(referenced_cells_.begin(), referenced_cells_.end()),
+                            referenced_cells_.end());
+    referenced_cells_.shrink_to_fit();
+    program_.clear();
+    root_expr_->Compile(program_);
+    program_.shrink_to_fit();
 }
 
 FormulaAST::~FormulaAST() = default;
@@ -2,10 +2,12 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "formula_program.h"
 
 #include <forward_list>
 #include <functional>
 #include <stdexcept>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
@@ -23,7 +25,7 @@ public:
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(std::function<CellInterface::Value(Position)>& cell_value_getter) const;
+    double Execute(std::function<CellInterface::ValueView(Position)>& cell_value_getter) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
@@ -36,14 +38,42 @@ public:
         return cells_;
     }
 
+    // sorted cells without duplicates
+    const std::vector<Position>& GetReferencedCells() const {
+        return referenced_cells_;
+    }
+
+    // the same expression in postfix form, see FormulaProgram
+    const FormulaProgram& GetProgram() const {
+        return program_;
+    }
+
+    // Replaces every valid reference with update(reference) in place; an
+    // invalid result turns the reference into #REF!. The referenced cells
+    // and the program are rebuilt afterwards.
+    void UpdateReferences(const std::function<Position(Position)>& update);
+
 private:
+    void Rebuild();
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+
+    // deduplicated copy of cells_ in a contiguous array, built once so that
+    // callers can get the references without allocating
+    std::vector<Position> referenced_cells_;
+
+    FormulaProgram program_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// Rebuilds the AST of a compiled formula without parsing its text: the
+// program keeps every node of the tree, so the expression is printed the same
+// way. Throws FormulaException if the program is malformed.
+FormulaAST BuildFormulaAST(const FormulaProgram& program);
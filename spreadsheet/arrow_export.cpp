@@ -0,0 +1,274 @@
+#include "arrow_export.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+// Порядок категорий в словаре ошибок
+const FormulaError::Category ERROR_CATEGORIES[] = {
+    FormulaError::Category::Ref,
+    FormulaError::Category::Value,
+    FormulaError::Category::Arithmetic,
+};
+
+// Данные выгруженной схемы (private_data)
+struct SchemaData {
+    std::string format;
+    std::string name;
+    std::vector<std::unique_ptr<ArrowSchema>> owned_children;
+    std::vector<ArrowSchema*> children;
+    std::unique_ptr<ArrowSchema> dictionary;
+
+    // Получатель может забрать дочернюю схему себе, сбросив её release
+    ~SchemaData() {
+        for (const auto& child : owned_children) {
+            if (child->release) {
+                child->release(child.get());
+            }
+        }
+        if (dictionary && dictionary->release) {
+            dictionary->release(dictionary.get());
+        }
+    }
+};
+
+void ReleaseSchema(ArrowSchema* schema) {
+    delete static_cast<SchemaData*>(schema->private_data);
+    schema->release = nullptr;
+}
+
+void MakeSchema(ArrowSchema* schema, std::string format, std::string name,
+                std::vector<std::unique_ptr<ArrowSchema>> children = {},
+                std::unique_ptr<ArrowSchema> dictionary = nullptr) {
+    auto data = std::make_unique<SchemaData>();
+    data->format = std::move(format);
+    data->name = std::move(name);
+    data->owned_children = std::move(children);
+    for (const auto& child : data->owned_children) {
+        data->children.push_back(child.get());
+    }
+    data->dictionary = std::move(dictionary);
+
+    schema->format = data->format.c_str();
+    schema->name = data->name.c_str();
+    schema->metadata = nullptr;
+    schema->flags = ARROW_FLAG_NULLABLE;
+    schema->n_children = static_cast<int64_t>(data->children.size());
+    schema->children = data->children.data();
+    schema->dictionary = data->dictionary.get();
+    schema->release = ReleaseSchema;
+    schema->private_data = data.release();
+}
+
+// Данные выгруженного массива (private_data): буферы, на которые
+// ссылается ArrowArray::buffers, и дочерние массивы
+struct ArrayData {
+    std::vector<std::uint8_t> validity;
+    std::vector<double> numbers;
+    std::vector<std::int32_t> offsets;
+    std::string text;
+    std::vector<std::int8_t> indices;
+
+    std::vector<const void*> buffers;
+    std::vector<std::unique_ptr<ArrowArray>> owned_children;
+    std::vector<ArrowArray*> children;
+    std::unique_ptr<ArrowArray> dictionary;
+
+    ~ArrayData() {
+        for (const auto& child : owned_children) {
+            if (child->release) {
+                child->release(child.get());
+            }
+        }
+        if (dictionary && dictionary->release) {
+            dictionary->release(dictionary.get());
+        }
+    }
+};
+
+void ReleaseArray(ArrowArray* array) {
+    delete static_cast<ArrayData*>(array->private_data);
+    array->release = nullptr;
+}
+
+// Заполняет array по data. Буферы data->buffers должны указывать на
+// данные data: при перемещении unique_ptr векторы не перемещаются
+void MakeArray(ArrowArray* array, std::unique_ptr<ArrayData> data, std::int64_t length,
+               std::int64_t null_count) {
+    for (const auto& child : data->owned_children) {
+        data->children.push_back(child.get());
+    }
+    array->length = length;
+    array->null_count = null_count;
+    array->offset = 0;
+    array->n_buffers = static_cast<int64_t>(data->buffers.size());
+    array->n_children = static_cast<int64_t>(data->children.size());
+    array->buffers = data->buffers.data();
+    array->children = data->children.data();
+    array->dictionary = data->dictionary.get();
+    array->release = ReleaseArray;
+    array->private_data = data.release();
+}
+
+// Битовая карта действительных значений: бит i (младшие биты байта идут
+// первыми) установлен, если значение i не null. Возвращает число null
+template <typename IsValid>
+std::int64_t BuildValidity(std::vector<std::uint8_t>& validity, std::size_t length,
+                           IsValid is_valid) {
+    validity.assign((length + 7) / 8, 0);
+    std::int64_t null_count = 0;
+    for (std::size_t i = 0; i < length; ++i) {
+        const bool valid = is_valid(i);
+        validity[i / 8] |= static_cast<std::uint8_t>(valid) << (i % 8);
+        null_count += !valid;
+    }
+    return null_count;
+}
+
+bool IsText(ShadowStatus status) {
+    return status == ShadowStatus::Text || status == ShadowStatus::NumericText;
+}
+
+int ErrorIndex(ShadowStatus status) {
+    switch (status) {
+        case ShadowStatus::RefError:
+            return 0;
+        case ShadowStatus::ValueError:
+            return 1;
+        case ShadowStatus::ArithmeticError:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+// Массив utf8 из строк strings[i] для i, где is_valid(i)
+template <typename IsValid>
+void MakeUtf8Array(ArrowArray* array, const std::string_view* strings, std::size_t length,
+                   IsValid is_valid) {
+    auto data = std::make_unique<ArrayData>();
+    const std::int64_t null_count = BuildValidity(data->validity, length, is_valid);
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < length; ++i) {
+        total += is_valid(i) ? strings[i].size() : 0;
+    }
+    if (total > static_cast<std::size_t>(std::numeric_limits<std::int32_t>::max())) {
+        throw std::length_error("Text column exceeds 2 GiB of utf8 data");
+    }
+
+    data->offsets.resize(length + 1);
+    data->text.resize(total);
+    std::size_t end = 0;
+    for (std::size_t i = 0; i < length; ++i) {
+        if (is_valid(i)) {
+            strings[i].copy(data->text.data() + end, strings[i].size());
+            end += strings[i].size();
+        }
+        data->offsets[i + 1] = static_cast<std::int32_t>(end);
+    }
+    data->buffers = {data->validity.data(), data->offsets.data(), data->text.data()};
+    MakeArray(array, std::move(data), static_cast<std::int64_t>(length), null_count);
+}
+
+std::unique_ptr<ArrowArray> MakeErrorDictionary() {
+    std::vector<std::string_view> names;
+    for (FormulaError::Category category : ERROR_CATEGORIES) {
+        names.push_back(FormulaError(category).ToString());
+    }
+    auto dictionary = std::make_unique<ArrowArray>();
+    MakeUtf8Array(dictionary.get(), names.data(), names.size(), [](std::size_t) {
+        return true;
+    });
+    return dictionary;
+}
+
+std::unique_ptr<ArrowSchema> MakeColumnSchema(int col) {
+    // Имя столбца - позиция первой строки без номера строки
+    std::string name = Position{0, col}.ToString();
+    name.pop_back();
+
+    std::vector<std::unique_ptr<ArrowSchema>> fields;
+    for (int i = 0; i < 3; ++i) {
+        fields.push_back(std::make_unique<ArrowSchema>());
+    }
+    MakeSchema(fields[0].get(), "g", "number");
+    MakeSchema(fields[1].get(), "u", "text");
+    auto dictionary = std::make_unique<ArrowSchema>();
+    MakeSchema(dictionary.get(), "u", "");
+    MakeSchema(fields[2].get(), "c", "error", {}, std::move(dictionary));
+
+    auto schema = std::make_unique<ArrowSchema>();
+    MakeSchema(schema.get(), "+s", std::move(name), std::move(fields));
+    return schema;
+}
+
+std::unique_ptr<ArrowArray> MakeColumnArray(std::size_t rows, const double* numbers,
+                                            const ShadowStatus* statuses,
+                                            const std::string_view* strings) {
+    auto number = std::make_unique<ArrayData>();
+    const std::int64_t number_nulls = BuildValidity(number->validity, rows, [&](std::size_t i) {
+        return statuses[i] == ShadowStatus::Number;
+    });
+    number->numbers.assign(numbers, numbers + rows);
+    number->buffers = {number->validity.data(), number->numbers.data()};
+
+    auto error = std::make_unique<ArrayData>();
+    const std::int64_t error_nulls = BuildValidity(error->validity, rows, [&](std::size_t i) {
+        return ErrorIndex(statuses[i]) >= 0;
+    });
+    error->indices.resize(rows);
+    for (std::size_t i = 0; i < rows; ++i) {
+        error->indices[i] = static_cast<std::int8_t>(std::max(ErrorIndex(statuses[i]), 0));
+    }
+    error->buffers = {error->validity.data(), error->indices.data()};
+    error->dictionary = MakeErrorDictionary();
+
+    auto column = std::make_unique<ArrayData>();
+    column->buffers = {nullptr};
+    for (int i = 0; i < 3; ++i) {
+        column->owned_children.push_back(std::make_unique<ArrowArray>());
+    }
+    const auto length = static_cast<std::int64_t>(rows);
+    MakeArray(column->owned_children[0].get(), std::move(number), length, number_nulls);
+    MakeUtf8Array(column->owned_children[1].get(), strings, rows, [&](std::size_t i) {
+        return IsText(statuses[i]);
+    });
+    MakeArray(column->owned_children[2].get(), std::move(error), length, error_nulls);
+
+    auto array = std::make_unique<ArrowArray>();
+    MakeArray(array.get(), std::move(column), length, 0);
+    return array;
+}
+
+}  // namespace
+
+void ExportArrow(const Sheet& sheet, ArrowSchema* schema, ArrowArray* array) {
+    const Size size = sheet.GetPrintableSize();
+    const auto rows = static_cast<std::size_t>(size.rows);
+
+    std::vector<std::unique_ptr<ArrowSchema>> column_schemas;
+    auto root = std::make_unique<ArrayData>();
+    root->buffers = {nullptr};
+
+    std::vector<double> numbers(rows);
+    std::vector<ShadowStatus> statuses(rows);
+    std::vector<std::string_view> strings(rows);
+    for (int col = 0; col < size.cols; ++col) {
+        sheet.GetValues({{0, col}, {size.rows, 1}}, numbers.data(), statuses.data(),
+                        strings.data());
+        column_schemas.push_back(MakeColumnSchema(col));
+        root->owned_children.push_back(
+            MakeColumnArray(rows, numbers.data(), statuses.data(), strings.data()));
+    }
+
+    MakeSchema(schema, "+s", "", std::move(column_schemas));
+    MakeArray(array, std::move(root), size.rows, 0);
+}
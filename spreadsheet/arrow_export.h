@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+
+class Sheet;
+
+// Структуры Arrow C data interface
+// (https://arrow.apache.org/docs/format/CDataInterface.html). Определены по
+// спецификации, чтобы не зависеть от библиотеки Arrow; защита от повторного
+// определения совпадает с заголовком abi.h самой Arrow.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+extern "C" {
+
+struct ArrowSchema {
+    const char* format;
+    const char* name;
+    const char* metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema** children;
+    struct ArrowSchema* dictionary;
+
+    void (*release)(struct ArrowSchema*);
+    void* private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void** buffers;
+    struct ArrowArray** children;
+    struct ArrowArray* dictionary;
+
+    void (*release)(struct ArrowArray*);
+    void* private_data;
+};
+
+}  // extern "C"
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+// Выгружает значения печатной области таблицы в формате Arrow C data
+// interface: структура (формат "+s") со столбцами таблицы "A", "B", ...,
+// каждый столбец - структура из трёх полей одной длины, равной числу строк
+// печатной области:
+//   number - float64, значения формул-чисел;
+//   text   - utf8, значения текстовых ячеек;
+//   error  - int8 со словарём utf8 из FormulaError::ToString ("#REF!",
+//            "#VALUE", "#ARITHM!"), ошибки формул.
+// В каждой строке задано не больше одного поля, пустой ячейке соответствуют
+// три null. Формулы перед выгрузкой вычисляются. Данные не зависят от
+// таблицы; их освобождают вызовом release у schema и array.
+void ExportArrow(const Sheet& sheet, ArrowSchema* schema, ArrowArray* array);
@@ -1,9 +1,10 @@
 #include "cell.h"
 
+#include "sheet.h"
+
 #include <cassert>
 #include <iostream>
 #include <string>
-#include <optional>
 
 using namespace std::literals;
 
@@ -13,55 +14,75 @@ class Impl {
 public:
     virtual ~Impl() = default;
 
-    virtual CellInterface::Value GetValue(const SheetInterface& /*sheet_*/) const = 0;
+    // Строковое значение ссылается на строку, принадлежащую реализации
+    virtual CellValue GetValue(const SheetInterface& /*sheet_*/) const = 0;
     virtual std::string GetText() const = 0;
 
-    virtual std::vector<Position> GetReferencedCells() const { return {}; }
+    virtual PositionSpan GetReferencedCellsView() const { return {}; }
+    virtual const FormulaProgram* GetProgram() const { return nullptr; }
+    virtual FormulaInterface* GetFormula() { return nullptr; }
+
+    virtual bool IsEmpty() const { return false; }
 };
 
 class EmptyImpl : public Impl {
 public:
-    CellInterface::Value GetValue(const SheetInterface& /*sheet_*/) const override {
-        return "";
+    CellValue GetValue(const SheetInterface& /*sheet_*/) const override {
+        static const std::string empty;
+        return CellValue::String(&empty);
     }
     std::string GetText() const override {
         return "";
     }
+
+    bool IsEmpty() const override {
+        return true;
+    }
 };
 
 class TextImpl : public Impl {
 public:
-    TextImpl(std::string text)
-    : text_(std::move(text)) {
+    TextImpl(StringPool& pool, std::string_view text)
+    : pool_(pool)
+    , escaped_(!text.empty() && text[0] == ESCAPE_SIGN)
+    , value_id_(pool.Acquire(escaped_ ? text.substr(1) : text)) {
     }
 
-    CellInterface::Value GetValue(const SheetInterface& /*sheet_*/) const override {
-        if (!text_.empty() && text_[0] == ESCAPE_SIGN) {
-            return text_.substr(1);
-        } else {
-            return text_;
-        }
+    TextImpl(const TextImpl&) = delete;
+    TextImpl& operator=(const TextImpl&) = delete;
+
+    ~TextImpl() override {
+        pool_.Release(value_id_);
+    }
+
+    CellValue GetValue(const SheetInterface& /*sheet_*/) const override {
+        return CellValue::String(&pool_.Get(value_id_));
     }
 
     std::string GetText() const override {
-        return text_;
+        const std::string& value = pool_.Get(value_id_);
+        return escaped_ ? ESCAPE_SIGN + value : value;
     }
 private:
-    std::string text_;
+    // Значение хранится в пуле строк листа без экранирующего символа, чтобы
+    // кэш мог ссылаться на строку пула целиком
+    StringPool& pool_;
+    bool escaped_;
+    StringPool::Id value_id_;
 };
 
 class FormulaImpl : public Impl {
 public:
-    FormulaImpl(std::string expression)
-    : formula_(ParseFormula(std::move(expression))) {
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula)
+    : formula_(std::move(formula)) {
     }
 
-    CellInterface::Value GetValue(const SheetInterface& sheet_) const override {
+    CellValue GetValue(const SheetInterface& sheet_) const override {
         FormulaInterface::Value value = formula_->Evaluate(sheet_);
         if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
+            return CellValue::Number(std::get<double>(value));
         } else { // std::holds_alternative<FormulaError>(value)
-            return std::get<FormulaError>(value);
+            return CellValue::Error(std::get<FormulaError>(value));
         }
     }
 
@@ -69,8 +90,16 @@ public:
         return "="s + formula_->GetExpression();
     }
 
-    std::vector<Position> GetReferencedCells() const override {
-        return formula_->GetReferencedCells();
+    PositionSpan GetReferencedCellsView() const override {
+        return formula_->GetReferencedCellsView();
+    }
+
+    const FormulaProgram* GetProgram() const override {
+        return &formula_->GetProgram();
+    }
+
+    FormulaInterface* GetFormula() override {
+        return formula_.get();
     }
 
 private:
@@ -79,7 +108,7 @@ private:
 
 }
 
-Cell::Cell(const SheetInterface& sheet)
+Cell::Cell(const Sheet& sheet)
 : impl_(std::make_unique<CellImpl::EmptyImpl>())
 , sheet_(sheet) {
 }
@@ -90,21 +119,29 @@ void Cell::Set(std::string text) {
     if (text.empty()) {
         impl_ = std::make_unique<CellImpl::EmptyImpl>();
     } else if (text[0] == FORMULA_SIGN && text.size() > 1) {
-        impl_ = std::make_unique<CellImpl::FormulaImpl>(text.substr(1));
+        impl_ = std::make_unique<CellImpl::FormulaImpl>(ParseFormula(text.substr(1)));
     } else {
-        impl_ = std::make_unique<CellImpl::TextImpl>(std::move(text));
+        impl_ = std::make_unique<CellImpl::TextImpl>(sheet_.GetStringPool(), text);
     }
 }
 
+void Cell::SetFormula(const FormulaProgram& program) {
+    impl_ = std::make_unique<CellImpl::FormulaImpl>(MakeFormula(program));
+}
+
 void Cell::Clear() {
     impl_ = std::make_unique<CellImpl::EmptyImpl>();
+    assert(cache_);
+    *cache_ = CellValue();
+    stamps_->changed_at = sheet_.GetEpoch();
 }
 
 Cell::Value Cell::GetValue() const {
-    if (!cache_.has_value()) {
-        cache_ = impl_->GetValue(sheet_);
-    }
-    return cache_.value();
+    return GetCachedValue().ToValue();
+}
+
+Cell::ValueView Cell::GetValueView() const {
+    return GetCachedValue().ToView();
 }
 
 std::string Cell::GetText() const {
@@ -112,9 +149,139 @@ std::string Cell::GetText() const {
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    PositionSpan cells = impl_->GetReferencedCellsView();
+    return {cells.begin(), cells.end()};
+}
+
+PositionSpan Cell::GetReferencedCellsView() const {
+    return impl_->GetReferencedCellsView();
+}
+
+const FormulaProgram* Cell::GetProgram() const {
+    return impl_->GetProgram();
+}
+
+FormulaInterface* Cell::GetFormula() {
+    return impl_->GetFormula();
+}
+
+bool Cell::IsEmpty() const {
+    return impl_->IsEmpty();
+}
+
+CellValue Cell::GetCachedValue() const {
+    if (!IsCacheValid()) {
+        Evaluate();
+    }
+    return *cache_;
+}
+
+bool Cell::IsCacheValid() const {
+    assert(cache_);
+    if (cache_->IsNone()) {
+        return false;
+    }
+    // В режиме Epoch кэш не сбрасывается при изменениях: он действителен,
+    // если проверен на текущей правке таблицы. Значение ячейки без ссылок
+    // меняется только вместе с самой ячейкой, и проверять его не нужно
+    return sheet_.GetRecalculationMode() != RecalculationMode::Epoch
+        || impl_->GetReferencedCellsView().empty()
+        || stamps_->verified_at == sheet_.GetEpoch();
+}
+
+bool Cell::NeedsEvaluation() const {
+    return !IsCacheValid() && !impl_->GetReferencedCellsView().empty();
+}
+
+bool Cell::HasChangedInputs() const {
+    for (Position pos : impl_->GetReferencedCellsView()) {
+        const Cell* ref = sheet_.GetConcreteCell(pos);
+        if (!ref || ref->stamps_->changed_at > stamps_->verified_at) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Cell::Evaluate() const {
+    // Сначала вычисляются невычисленные ячейки, от которых зависит данная, в
+    // топологическом порядке: обход в глубину с явным стеком, ячейка
+    // вычисляется после всех своих аргументов. Поэтому при вычислении любой
+    // формулы значения ячеек, на которые она ссылается, уже в кэше, и
+    // рекурсии через GetValue не возникает при любой длине цепочки.
+    struct Frame {
+        const Cell* cell;
+        PositionSpan refs;
+        std::size_t next = 0;
+    };
+    std::vector<Frame> stack{{this, impl_->GetReferencedCellsView()}};
+
+    while (!stack.empty()) {
+        Frame& top = stack.back();
+        if (top.next < top.refs.size()) {
+            const Cell* ref = sheet_.GetConcreteCell(top.refs[top.next++]);
+            if (ref && ref->NeedsEvaluation()) {
+                stack.push_back({ref, ref->impl_->GetReferencedCellsView()});
+            }
+        } else {
+            top.cell->Update();
+            stack.pop_back();
+        }
+    }
+}
+
+void Cell::Update() const {
+    // Аргументы уже проверены: если ни один не изменился после последней
+    // проверки этой ячейки, кэш остаётся прежним
+    if (cache_->IsNone() || HasChangedInputs()) {
+        StoreValue(impl_->GetValue(sheet_));
+    } else {
+        stamps_->verified_at = sheet_.GetEpoch();
+    }
+}
+
+void Cell::StoreValue(CellValue value) const {
+    assert(cache_);
+    const std::uint64_t epoch = sheet_.GetEpoch();
+    if (cache_->IsNone() || !(value == *cache_)) {
+        *cache_ = value;
+        stamps_->changed_at = epoch;
+    }
+    stamps_->verified_at = epoch;
 }
 
 void Cell::ResetCache() const {
-    cache_.reset();
+    assert(cache_);
+    *cache_ = CellValue();
+}
+
+void Cell::MarkChanged() const {
+    ResetCache();
+    stamps_->changed_at = sheet_.GetEpoch();
+}
+
+CellValue Cell::PeekCache() const {
+    assert(cache_);
+    return *cache_;
+}
+
+bool Cell::Recalculate() const {
+    return Recalculate(PeekCache());
+}
+
+bool Cell::Recalculate(CellValue previous) const {
+    ResetCache();
+    return previous.IsNone() || !(previous == GetCachedValue());
+}
+
+void Cell::Attach(CellValue* cache, CellStamps* stamps) {
+    cache_ = cache;
+    stamps_ = stamps;
+    *cache_ = CellValue();
+    *stamps_ = {sheet_.GetEpoch(), 0};
+}
+
+void Cell::Detach() {
+    cache_ = nullptr;
+    stamps_ = nullptr;
 }
\ No newline at end of file
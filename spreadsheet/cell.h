@@ -1,31 +1,90 @@
 #pragma once
 
+#include "cell_value.h"
 #include "common.h"
 #include "formula.h"
 
-#include <optional>
+#include <cstdint>
 
 namespace CellImpl {
 class Impl;
 }
 
+class Sheet;
+
+// Метки правок таблицы (см. Sheet::GetEpoch): когда значение ячейки последний
+// раз изменилось и когда её кэш последний раз был проверен
+struct CellStamps {
+    std::uint64_t changed_at = 0;
+    std::uint64_t verified_at = 0;
+};
+
+// Ячейка хранит только исходные данные: текст или формулу. Кэш значения и
+// метки правок лежат в плотных массивах блока CellStorage, куда ячейку
+// подключает хранилище: вычисление и печать читают и пишут только их. Пока
+// ячейка не помещена в хранилище, её значение недоступно.
 class Cell : public CellInterface {
 public:
-    Cell(const SheetInterface& sheet);
+    Cell(const Sheet& sheet);
     ~Cell();
 
     void Set(std::string text);
+    // Задаёт формулу по программе без разбора текста (см. MakeFormula)
+    void SetFormula(const FormulaProgram& program);
     void Clear();
 
     Value GetValue() const override;
+    ValueView GetValueView() const override;
+    // Значение во внутреннем представлении (формула вычисляется при
+    // необходимости)
+    CellValue GetCachedValue() const;
     std::string GetText() const override;
 
     std::vector<Position> GetReferencedCells() const override;
+    PositionSpan GetReferencedCellsView() const;
+
+    // Программа формулы или nullptr, если в ячейке не формула
+    const FormulaProgram* GetProgram() const;
+    // Формула ячейки или nullptr. Через неё таблица изменяет ссылки формулы
+    // при вставке и удалении строк и столбцов
+    FormulaInterface* GetFormula();
+
+    bool IsEmpty() const;
+
+    // Нужно ли вычислять формулу ячейки при чтении значения
+    bool NeedsEvaluation() const;
+    // Можно ли прочитать значение из кэша, ничего в ячейке не записывая
+    bool IsCacheValid() const;
+
+    // Записывает в кэш значение, вычисленное вне ячейки (например,
+    // ColumnKernel). Аргументы формулы к этому моменту должны быть вычислены
+    void StoreValue(CellValue value) const;
 
     void ResetCache() const;
+    // Сбрасывает кэш и отмечает значение изменённым на текущей правке: для
+    // формулы, изменённой на месте (см. Sheet::DeleteRows)
+    void MarkChanged() const;
+
+    // Кэшированное значение без вычисления (CellValue(), если кэша нет)
+    CellValue PeekCache() const;
+
+    // Вычисляет значение заново. Возвращает false, если оно совпало с
+    // прежним значением previous (по умолчанию - кэшем этой ячейки).
+    bool Recalculate() const;
+    bool Recalculate(CellValue previous) const;
+
+    // Вызываются CellStorage: подключают ячейку к месту в блоке хранилища
+    // (кэш при этом сбрасывается) и отключают от него
+    void Attach(CellValue* cache, CellStamps* stamps);
+    void Detach();
 
 private:
     std::unique_ptr<CellImpl::Impl> impl_;
-    const SheetInterface& sheet_;
-    mutable std::optional<Value> cache_;
+    const Sheet& sheet_;
+    CellValue* cache_ = nullptr;
+    CellStamps* stamps_ = nullptr;
+
+    bool HasChangedInputs() const;
+    void Evaluate() const;
+    void Update() const;
 };
\ No newline at end of file
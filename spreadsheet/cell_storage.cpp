@@ -0,0 +1,108 @@
+#include "cell_storage.h"
+
+#include <functional>
+#include <string>
+
+Cell* CellStorage::Get(Position pos) const {
+    PositionKey key = ToKey(pos);
+    auto it = blocks_.find(BlockKey(key));
+    if (it == blocks_.end()) {
+        return nullptr;
+    }
+    return it->second->cells[SlotIndex(key)].get();
+}
+
+std::unique_ptr<Cell> CellStorage::Place(Position pos, std::unique_ptr<Cell> cell) {
+    PositionKey key = ToKey(pos);
+    std::unique_ptr<Block>& block = blocks_[BlockKey(key)];
+    if (block == nullptr) {
+        block = std::make_unique<Block>();
+        Group& group = groups_[GroupKey(BlockKey(key))];
+        group.blocks |= std::uint64_t{1} << GroupIndex(BlockKey(key));
+        block->group = &group;
+    }
+    const int index = SlotIndex(key);
+    std::unique_ptr<Cell>& slot = block->cells[index];
+    block->Invalidate();
+    if (slot == nullptr) {
+        ++block->count;
+        ++size_;
+    } else {
+        slot->Detach();
+    }
+    cell->Attach(&block->values[index], &block->stamps[index]);
+    std::swap(slot, cell);
+    return cell;
+}
+
+std::unique_ptr<Cell> CellStorage::Extract(Position pos) {
+    PositionKey key = ToKey(pos);
+    auto it = blocks_.find(BlockKey(key));
+    if (it == blocks_.end()) {
+        return nullptr;
+    }
+    std::unique_ptr<Cell> cell = std::move(it->second->cells[SlotIndex(key)]);
+    it->second->Invalidate();
+    if (cell != nullptr) {
+        cell->Detach();
+        --size_;
+        if (--it->second->count == 0) {
+            auto group = groups_.find(GroupKey(it->first));
+            group->second.blocks &= ~(std::uint64_t{1} << GroupIndex(it->first));
+            if (group->second.blocks == 0) {
+                groups_.erase(group);
+            }
+            blocks_.erase(it);
+        }
+    }
+    return cell;
+}
+
+std::size_t CellStorage::Size() const {
+    return size_;
+}
+
+void CellStorage::Compact() {
+    blocks_.rehash(0);
+    groups_.rehash(0);
+}
+
+void CellStorage::MarkChanged(Position pos) {
+    auto it = blocks_.find(BlockKey(ToKey(pos)));
+    if (it != blocks_.end()) {
+        it->second->Invalidate();
+    }
+}
+
+std::uint64_t CellStorage::GetGroupHash(PositionKey group_key, const Group& group) const {
+    if (!group.hash_valid) {
+        std::uint64_t hash = 0;
+        for (int index = 0; index < GROUP_SIZE; ++index) {
+            if ((group.blocks >> index & 1) != 0) {
+                const PositionKey block_key = group_key * GROUP_SIZE + index;
+                hash += GetHash(block_key, *blocks_.at(block_key));
+            }
+        }
+        group.hash = hash;
+        group.hash_valid = true;
+    }
+    return group.hash;
+}
+
+std::uint64_t CellStorage::GetHash(PositionKey block_key, const Block& block) {
+    if (!block.hash_valid) {
+        // Сумма хешей пар (позиция, текст): пустые ячейки-заглушки не влияют
+        // на хеш, как и отсутствующие
+        std::uint64_t hash = 0;
+        for (int i = 0; i < BLOCK_SIZE; ++i) {
+            const Cell* cell = block.cells[i].get();
+            if (cell && !cell->IsEmpty()) {
+                const std::uint64_t text_hash = std::hash<std::string>{}(cell->GetText());
+                hash += PositionKeyHasher{}(text_hash ^ (block_key * BLOCK_SIZE + i));
+            }
+        }
+        block.hash = hash;
+        block.hash_valid = true;
+    }
+    return block.hash;
+}
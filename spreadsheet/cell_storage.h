@@ -0,0 +1,200 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "position_key.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+// Разреженное хранилище ячеек. Ячейки сгруппированы в блоки 8x8, которые
+// соответствуют отрезкам Z-кривой: соседние ячейки как по строке, так и по
+// столбцу попадают в один блок и лежат рядом в памяти. Память и время
+// поиска зависят только от числа занятых блоков.
+//
+// Кэши значений ячеек блока лежат в отдельном плотном массиве (64 значения
+// по 8 байт - 8 кэш-линий), метки правок - в другом, а сами объекты ячеек с
+// текстом и формулами - в третьем, по тому же номеру слота. Вычисление
+// затрагивает только кэши и метки, правка - только объекты ячеек.
+class CellStorage {
+public:
+    static constexpr int BLOCK_SIDE = 8;
+    static constexpr int BLOCK_SIZE = BLOCK_SIDE * BLOCK_SIDE;
+
+    Cell* Get(Position pos) const;
+
+    // Помещает ячейку в позицию и возвращает ячейку, которая занимала её
+    // раньше (или nullptr). Новая ячейка подключается к кэшу слота со
+    // сброшенным значением, прежняя отключается от него
+    std::unique_ptr<Cell> Place(Position pos, std::unique_ptr<Cell> cell);
+
+    // Извлекает ячейку из хранилища и отключает её от кэша слота. Пустые
+    // блоки удаляются сразу
+    std::unique_ptr<Cell> Extract(Position pos);
+
+    std::size_t Size() const;
+
+    // Обходит все занятые позиции в порядке, не определённом относительно
+    // строк и столбцов: блок за блоком, внутри блока по Z-кривой
+    template <typename Func>
+    void ForEach(Func func) const;
+
+    // Обходит занятые позиции, у которых координата axis не меньше first.
+    // Группы и блоки, целиком лежащие до first, пропускаются без обхода
+    // их ячеек
+    template <typename Func>
+    void ForEachFrom(int Position::*axis, int first, Func func) const;
+
+    // Освобождает лишние корзины хеш-таблицы блоков
+    void Compact();
+
+    // Отмечает, что текст ячейки в pos изменился на месте (Cell::Clear), а
+    // не заменой через Place или Extract
+    void MarkChanged(Position pos);
+
+    // Вызывает func(Position first, Position last) для каждого блока
+    // (first и last - его углы), тексты непустых ячеек которого в lhs и rhs
+    // могут различаться. Сравниваются хеши групп из 64 блоков, и только в
+    // группах с разными хешами - хеши блоков. Хеши вычисляются при первом
+    // сравнении и пересчитываются только у изменённых блоков и групп.
+    template <typename Func>
+    static void ForEachDifferentBlock(const CellStorage& lhs, const CellStorage& rhs, Func func);
+
+private:
+    static constexpr int GROUP_SIZE = 64;
+
+    // Группа из GROUP_SIZE соседних по Z-кривой блоков (64x64 ячейки)
+    struct Group {
+        // Маска занятых блоков группы
+        std::uint64_t blocks = 0;
+        // Сумма хешей блоков
+        mutable std::uint64_t hash = 0;
+        mutable bool hash_valid = false;
+    };
+
+    struct Block {
+        std::array<CellValue, BLOCK_SIZE> values;
+        std::array<CellStamps, BLOCK_SIZE> stamps;
+        std::array<std::unique_ptr<Cell>, BLOCK_SIZE> cells;
+        int count = 0;
+
+        // Хеш пар (позиция, текст) непустых ячеек; 0 - у блока без непустых
+        // ячеек
+        mutable std::uint64_t hash = 0;
+        mutable bool hash_valid = false;
+        Group* group = nullptr;
+
+        void Invalidate() {
+            hash_valid = false;
+            group->hash_valid = false;
+        }
+    };
+
+    std::uint64_t GetGroupHash(PositionKey group_key, const Group& group) const;
+    static std::uint64_t GetHash(PositionKey block_key, const Block& block);
+
+    // Вызывает func(block_key) для блоков группы, хеши которых в lhs и rhs
+    // различаются
+    template <typename Func>
+    static void ForEachDifferentBlockInGroup(const CellStorage& lhs, const CellStorage& rhs,
+                                             PositionKey group_key, Func func);
+
+    static PositionKey BlockKey(PositionKey key) {
+        return key / BLOCK_SIZE;
+    }
+    static PositionKey GroupKey(PositionKey block_key) {
+        return block_key / GROUP_SIZE;
+    }
+    static int GroupIndex(PositionKey block_key) {
+        return static_cast<int>(block_key % GROUP_SIZE);
+    }
+    static int SlotIndex(PositionKey key) {
+        return static_cast<int>(key % BLOCK_SIZE);
+    }
+
+    std::unordered_map<PositionKey, std::unique_ptr<Block>, PositionKeyHasher> blocks_;
+    std::unordered_map<PositionKey, Group, PositionKeyHasher> groups_;
+    std::size_t size_ = 0;
+};
+
+template <typename Func>
+void CellStorage::ForEachDifferentBlockInGroup(const CellStorage& lhs, const CellStorage& rhs,
+                                               PositionKey group_key, Func func) {
+    auto block_hash = [](const CellStorage& storage, PositionKey block_key) {
+        auto it = storage.blocks_.find(block_key);
+        return it != storage.blocks_.end() ? GetHash(block_key, *it->second) : 0;
+    };
+    auto lhs_group = lhs.groups_.find(group_key);
+    auto rhs_group = rhs.groups_.find(group_key);
+    const std::uint64_t blocks = (lhs_group != lhs.groups_.end() ? lhs_group->second.blocks : 0)
+        | (rhs_group != rhs.groups_.end() ? rhs_group->second.blocks : 0);
+    for (int index = 0; index < GROUP_SIZE; ++index) {
+        if ((blocks >> index & 1) == 0) {
+            continue;
+        }
+        const PositionKey block_key = group_key * GROUP_SIZE + index;
+        if (block_hash(lhs, block_key) != block_hash(rhs, block_key)) {
+            func(block_key);
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEachDifferentBlock(const CellStorage& lhs, const CellStorage& rhs,
+                                        Func func) {
+    auto report = [&func](PositionKey block_key) {
+        func(FromKey(block_key * BLOCK_SIZE), FromKey(block_key * BLOCK_SIZE + BLOCK_SIZE - 1));
+    };
+    for (const auto& [group_key, group] : lhs.groups_) {
+        auto it = rhs.groups_.find(group_key);
+        const std::uint64_t rhs_hash
+            = it != rhs.groups_.end() ? rhs.GetGroupHash(group_key, it->second) : 0;
+        if (lhs.GetGroupHash(group_key, group) != rhs_hash) {
+            ForEachDifferentBlockInGroup(lhs, rhs, group_key, report);
+        }
+    }
+    for (const auto& [group_key, group] : rhs.groups_) {
+        if (lhs.groups_.count(group_key) == 0 && rhs.GetGroupHash(group_key, group) != 0) {
+            ForEachDifferentBlockInGroup(lhs, rhs, group_key, report);
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEachFrom(int Position::*axis, int first, Func func) const {
+    // Группа - 8x8 блоков
+    constexpr int GROUP_SIDE = 8 * BLOCK_SIDE;
+    for (const auto& [group_key, group] : groups_) {
+        const PositionKey first_block = group_key * GROUP_SIZE;
+        if (FromKey(first_block * BLOCK_SIZE).*axis + GROUP_SIDE <= first) {
+            continue;
+        }
+        for (int index = 0; index < GROUP_SIZE; ++index) {
+            const PositionKey block_key = first_block + index;
+            if ((group.blocks >> index & 1) == 0
+                || FromKey(block_key * BLOCK_SIZE).*axis + BLOCK_SIDE <= first) {
+                continue;
+            }
+            const Block& block = *blocks_.at(block_key);
+            for (int i = 0; i < BLOCK_SIZE; ++i) {
+                const Position pos = FromKey(block_key * BLOCK_SIZE + i);
+                if (block.cells[i] != nullptr && pos.*axis >= first) {
+                    func(pos, *block.cells[i]);
+                }
+            }
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEach(Func func) const {
+    for (const auto& [block_key, block] : blocks_) {
+        for (int i = 0; i < BLOCK_SIZE; ++i) {
+            if (block->cells[i] != nullptr) {
+                func(FromKey(block_key * BLOCK_SIZE + i), *block->cells[i]);
+            }
+        }
+    }
+}
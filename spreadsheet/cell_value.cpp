@@ -0,0 +1,33 @@
+#include "cell_value.h"
+
+CellInterface::Value CellValue::ToValue() const {
+    assert(!IsNone());
+    if (IsNumber()) {
+        return AsNumber();
+    } else if (IsError()) {
+        return AsError();
+    } else {
+        return std::string(AsString());
+    }
+}
+
+CellInterface::ValueView CellValue::ToView() const {
+    assert(!IsNone());
+    if (IsNumber()) {
+        return AsNumber();
+    } else if (IsError()) {
+        return AsError();
+    } else {
+        return AsString();
+    }
+}
+
+bool CellValue::operator==(CellValue rhs) const {
+    // Числа сравниваются побитово: 0 и -0 печатаются по-разному, поэтому
+    // замена одного другим - изменение значения
+    if (bits_ == rhs.bits_) {
+        return true;
+    }
+    // Разные строки с одинаковым содержимым
+    return IsString() && rhs.IsString() && AsString() == rhs.AsString();
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "common.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Значение ячейки в 8 байтах (NaN-boxing). Число хранится как есть, а
+// остальные виды значений - в битах «тихого» NaN со знаком: тег в битах
+// 48-50 и полезная нагрузка в младших 48 битах (категория ошибки или
+// указатель на строку). Числа-NaN приводятся к одному каноническому NaN без
+// знака, поэтому с упакованными значениями не пересекаются.
+//
+// Используется внутри таблицы для кэша значений и при вычислении; наружу
+// значение отдаётся как CellInterface::Value или ValueView. Строка не
+// принадлежит значению: она должна жить, пока живо значение.
+class CellValue {
+public:
+    // Отсутствие значения (например, пустой кэш)
+    CellValue() = default;
+
+    static CellValue Number(double value) {
+        if (std::isnan(value)) {
+            return CellValue(CANONICAL_NAN);
+        }
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return CellValue(bits);
+    }
+
+    static CellValue Error(FormulaError error) {
+        return Box(TAG_ERROR, static_cast<std::uint64_t>(error.GetCategory()));
+    }
+
+    static CellValue String(const std::string* str) {
+        const auto address = reinterpret_cast<std::uintptr_t>(str);
+        assert((address & ~PAYLOAD_MASK) == 0);
+        return Box(TAG_STRING, address);
+    }
+
+    bool IsNone() const {
+        return bits_ == Box(TAG_NONE, 0).bits_;
+    }
+    bool IsNumber() const {
+        return (bits_ & BOX_MASK) != BOX_MASK;
+    }
+    bool IsError() const {
+        return GetTag() == TAG_ERROR;
+    }
+    bool IsString() const {
+        return GetTag() == TAG_STRING;
+    }
+
+    double AsNumber() const {
+        assert(IsNumber());
+        double value;
+        std::memcpy(&value, &bits_, sizeof(value));
+        return value;
+    }
+    FormulaError AsError() const {
+        assert(IsError());
+        return FormulaError(static_cast<FormulaError::Category>(bits_ & PAYLOAD_MASK));
+    }
+    std::string_view AsString() const {
+        assert(IsString());
+        return *reinterpret_cast<const std::string*>(static_cast<std::uintptr_t>(bits_ & PAYLOAD_MASK));
+    }
+
+    CellInterface::Value ToValue() const;
+    CellInterface::ValueView ToView() const;
+
+    // Числа сравниваются побитово, строки - по содержимому
+    bool operator==(CellValue rhs) const;
+
+private:
+    static constexpr std::uint64_t BOX_MASK = 0xFFF8'0000'0000'0000ull;
+    static constexpr std::uint64_t PAYLOAD_MASK = 0x0000'FFFF'FFFF'FFFFull;
+    static constexpr std::uint64_t CANONICAL_NAN = 0x7FF8'0000'0000'0000ull;
+    static constexpr int TAG_SHIFT = 48;
+
+    enum Tag : std::uint64_t {
+        TAG_NONE = 1,
+        TAG_ERROR = 2,
+        TAG_STRING = 3,
+    };
+
+    explicit CellValue(std::uint64_t bits)
+    : bits_(bits) {
+    }
+
+    static CellValue Box(Tag tag, std::uint64_t payload) {
+        return CellValue(BOX_MASK | (static_cast<std::uint64_t>(tag) << TAG_SHIFT) | payload);
+    }
+
+    std::uint64_t GetTag() const {
+        return IsNumber() ? 0 : (bits_ >> TAG_SHIFT) & 0b111;
+    }
+
+    std::uint64_t bits_ = BOX_MASK | (static_cast<std::uint64_t>(TAG_NONE) << TAG_SHIFT);
+};
+
+static_assert(sizeof(CellValue) == 8);
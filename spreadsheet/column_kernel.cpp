@@ -0,0 +1,198 @@
+#include "column_kernel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace {
+// Число дорожек, обрабатываемых за один проход программы: стек ядра
+// (stack_depth_ массивов по LANES чисел) должен помещаться в L1
+const std::size_t LANES = 256;
+
+Position Offset(Position pos, Position origin) {
+    return {pos.row - origin.row, pos.col - origin.col};
+}
+
+// Первая из ошибок: левого аргумента, правого аргумента, самой операции -
+// тот же порядок, что и при вычислении по дереву. Вычисляется без ветвлений,
+// чтобы цикл по дорожкам векторизовался
+ColumnKernel::ErrorCode FirstError(ColumnKernel::ErrorCode lhs, ColumnKernel::ErrorCode rhs,
+                                   ColumnKernel::ErrorCode own) {
+    const auto unless = [](ColumnKernel::ErrorCode error) {
+        return static_cast<ColumnKernel::ErrorCode>(-static_cast<int>(error == ColumnKernel::NO_ERROR));
+    };
+    return lhs | (unless(lhs) & (rhs | (unless(rhs) & own)));
+}
+
+// Бинарная операция над дорожками: lhs = lhs op rhs. Результат, не
+// являющийся конечным числом (r - r не равно нулю для бесконечностей и
+// NaN), даёт #ARITHM!
+template <typename Op>
+void ApplyBinary(double* lhs, ColumnKernel::ErrorCode* lhs_errors, const double* rhs,
+                 const ColumnKernel::ErrorCode* rhs_errors, std::size_t count, Op op) {
+    const ColumnKernel::ErrorCode arithmetic
+        = ColumnKernel::ToErrorCode(FormulaError::Category::Arithmetic);
+    for (std::size_t i = 0; i < count; ++i) {
+        lhs[i] = op(lhs[i], rhs[i]);
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        const bool failed = !(lhs[i] - lhs[i] == 0.0);
+        lhs_errors[i] = FirstError(lhs_errors[i], rhs_errors[i],
+                                   static_cast<ColumnKernel::ErrorCode>(arithmetic * failed));
+    }
+}
+
+void ApplyDivide(double* lhs, ColumnKernel::ErrorCode* lhs_errors, const double* rhs,
+                 const ColumnKernel::ErrorCode* rhs_errors, std::size_t count) {
+    const ColumnKernel::ErrorCode arithmetic
+        = ColumnKernel::ToErrorCode(FormulaError::Category::Arithmetic);
+    for (std::size_t i = 0; i < count; ++i) {
+        const bool failed = std::abs(rhs[i]) < DIVISION_EPSILON;
+        lhs_errors[i] = FirstError(lhs_errors[i], rhs_errors[i],
+                                   static_cast<ColumnKernel::ErrorCode>(arithmetic * failed));
+    }
+    ApplyBinary(lhs, lhs_errors, rhs, rhs_errors, count, [](double a, double b) {
+        return a / b;
+    });
+}
+
+}  // namespace
+
+ColumnKernel::ErrorCode ColumnKernel::ToErrorCode(FormulaError::Category category) {
+    return static_cast<ErrorCode>(static_cast<int>(category) + 1);
+}
+
+FormulaError ColumnKernel::ToFormulaError(ErrorCode code) {
+    assert(code != NO_ERROR);
+    return FormulaError(static_cast<FormulaError::Category>(code - 1));
+}
+
+ColumnKernel::ColumnKernel(const FormulaProgram& program, Position origin)
+: program_(program) {
+    std::size_t depth = 0;
+    for (FormulaInstruction& instruction : program_) {
+        switch (instruction.code) {
+            case FormulaInstruction::Code::Cell:
+                instruction.cell = Offset(instruction.cell, origin);
+                input_offsets_.push_back(instruction.cell);
+                [[fallthrough]];
+            case FormulaInstruction::Code::Number:
+            case FormulaInstruction::Code::RefError:
+                stack_depth_ = std::max(stack_depth_, ++depth);
+                break;
+            case FormulaInstruction::Code::Negate:
+            case FormulaInstruction::Code::Plus:
+                break;
+            default:
+                --depth;
+                break;
+        }
+    }
+}
+
+bool ColumnKernel::Matches(const FormulaProgram& program, Position pos) const {
+    if (program.size() != program_.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < program.size(); ++i) {
+        const FormulaInstruction& lhs = program_[i];
+        const FormulaInstruction& rhs = program[i];
+        if (lhs.code != rhs.code) {
+            return false;
+        }
+        if (lhs.code == FormulaInstruction::Code::Number && !(lhs.number == rhs.number)) {
+            return false;
+        }
+        if (lhs.code == FormulaInstruction::Code::Cell && !(lhs.cell == Offset(rhs.cell, pos))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const std::vector<Position>& ColumnKernel::GetInputOffsets() const {
+    return input_offsets_;
+}
+
+void ColumnKernel::Execute(const std::vector<const double*>& inputs,
+                           const std::vector<const ErrorCode*>& input_errors, std::size_t count,
+                           double* values, ErrorCode* errors) const {
+    assert(inputs.size() == input_offsets_.size() && input_errors.size() == inputs.size());
+
+    std::vector<double> stack(stack_depth_ * LANES);
+    std::vector<ErrorCode> stack_errors(stack_depth_ * LANES);
+
+    for (std::size_t begin = 0; begin < count; begin += LANES) {
+        const std::size_t lanes = std::min(LANES, count - begin);
+        std::size_t top = 0;
+        std::size_t input = 0;
+
+        for (const FormulaInstruction& instruction : program_) {
+            // Команда Cell, Number или RefError кладёт значения в ячейку стека
+            // top, операция изменяет верхние ячейки стека на месте
+            double* slot = stack.data() + top * LANES;
+            ErrorCode* slot_errors = stack_errors.data() + top * LANES;
+
+            switch (instruction.code) {
+                case FormulaInstruction::Code::Number:
+                    std::fill(slot, slot + lanes, instruction.number);
+                    std::fill(slot_errors, slot_errors + lanes, NO_ERROR);
+                    ++top;
+                    break;
+                case FormulaInstruction::Code::Cell:
+                    std::copy(inputs[input] + begin, inputs[input] + begin + lanes, slot);
+                    std::copy(input_errors[input] + begin, input_errors[input] + begin + lanes,
+                              slot_errors);
+                    ++input;
+                    ++top;
+                    break;
+                case FormulaInstruction::Code::RefError:
+                    std::fill(slot, slot + lanes, 0.0);
+                    std::fill(slot_errors, slot_errors + lanes,
+                              ToErrorCode(FormulaError::Category::Ref));
+                    ++top;
+                    break;
+                case FormulaInstruction::Code::Negate: {
+                    double* operand = stack.data() + (top - 1) * LANES;
+                    for (std::size_t i = 0; i < lanes; ++i) {
+                        operand[i] = -operand[i];
+                    }
+                    break;
+                }
+                case FormulaInstruction::Code::Plus:
+                    break;
+                default: {
+                    --top;
+                    double* lhs = stack.data() + (top - 1) * LANES;
+                    ErrorCode* lhs_errors = stack_errors.data() + (top - 1) * LANES;
+                    const double* rhs = stack.data() + top * LANES;
+                    const ErrorCode* rhs_errors = stack_errors.data() + top * LANES;
+
+                    if (instruction.code == FormulaInstruction::Code::Add) {
+                        ApplyBinary(lhs, lhs_errors, rhs, rhs_errors, lanes,
+                                    [](double a, double b) {
+                                        return a + b;
+                                    });
+                    } else if (instruction.code == FormulaInstruction::Code::Subtract) {
+                        ApplyBinary(lhs, lhs_errors, rhs, rhs_errors, lanes,
+                                    [](double a, double b) {
+                                        return a - b;
+                                    });
+                    } else if (instruction.code == FormulaInstruction::Code::Multiply) {
+                        ApplyBinary(lhs, lhs_errors, rhs, rhs_errors, lanes,
+                                    [](double a, double b) {
+                                        return a * b;
+                                    });
+                    } else { // instruction.code == FormulaInstruction::Code::Divide
+                        ApplyDivide(lhs, lhs_errors, rhs, rhs_errors, lanes);
+                    }
+                    break;
+                }
+            }
+        }
+
+        assert(top == 1);
+        std::copy(stack.begin(), stack.begin() + lanes, values + begin);
+        std::copy(stack_errors.begin(), stack_errors.begin() + lanes, errors + begin);
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+#include "formula_program.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Ядро для блока однотипных формул, записанных в столбце подряд (формула,
+// протянутая вниз: =A1*B1+C1, =A2*B2+C2, ...). У формул блока одна и та же
+// программа, а ссылки сдвинуты относительно ячейки формулы на одно и то же
+// смещение. Ядро вычисляет весь блок сразу: каждая команда программы
+// применяется к массиву дорожек (по одной на формулу), и такие циклы
+// компилятор векторизует. Ошибки хранятся в маске по дорожкам, так что
+// результат каждой дорожки совпадает с вычислением её формулы по отдельности.
+class ColumnKernel {
+public:
+    // Ошибка дорожки: NO_ERROR либо закодированная категория FormulaError
+    using ErrorCode = std::uint8_t;
+    static constexpr ErrorCode NO_ERROR = 0;
+
+    static ErrorCode ToErrorCode(FormulaError::Category category);
+    static FormulaError ToFormulaError(ErrorCode code);
+
+    // Ядро для формулы program, записанной в ячейке origin
+    ColumnKernel(const FormulaProgram& program, Position origin);
+
+    // Совпадает ли формула program в ячейке pos с формулой ядра с точностью
+    // до сдвига ссылок
+    bool Matches(const FormulaProgram& program, Position pos) const;
+
+    // Смещения ссылок относительно ячейки формулы, по одному на каждую
+    // команду Cell в порядке программы
+    const std::vector<Position>& GetInputOffsets() const;
+
+    // Вычисляет count формул. inputs[k][i] и input_errors[k][i] - значение
+    // k-й ссылки формулы i; результаты записываются в values и errors
+    void Execute(const std::vector<const double*>& inputs,
+                 const std::vector<const ErrorCode*>& input_errors, std::size_t count,
+                 double* values, ErrorCode* errors) const;
+
+private:
+    // Ссылки в program_ хранятся как смещения от ячейки формулы
+    FormulaProgram program_;
+    std::vector<Position> input_offsets_;
+    std::size_t stack_depth_ = 0;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -21,11 +22,46 @@ struct Position {
 
     static Position FromString(std::string_view str);
 
-    static const int MAX_ROWS = 16384;
+    static const int MAX_ROWS = 1048576;
     static const int MAX_COLS = 16384;
     static const Position NONE;
 };
 
+// Непрерывная последовательность позиций без владения (аналог
+// std::span<const Position>). Действительна, пока жив её владелец.
+class PositionSpan {
+public:
+    PositionSpan() = default;
+    PositionSpan(const Position* data, std::size_t size)
+    : data_(data)
+    , size_(size) {
+    }
+    PositionSpan(const std::vector<Position>& positions)
+    : data_(positions.data())
+    , size_(positions.size()) {
+    }
+
+    const Position* begin() const {
+        return data_;
+    }
+    const Position* end() const {
+        return data_ + size_;
+    }
+    std::size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    Position operator[](std::size_t index) const {
+        return data_[index];
+    }
+
+private:
+    const Position* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -33,6 +69,19 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область ячеек: левый верхний угол и размер.
+struct Range {
+    Position top_left;
+    Size size;
+
+    bool operator==(Range rhs) const;
+
+    // Область корректна, если её размер неотрицателен и она целиком лежит в
+    // пределах таблицы.
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -81,6 +130,9 @@ public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // То же значение без копирования текста. Строка принадлежит ячейке и
+    // действительна до следующего изменения таблицы
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -88,6 +140,8 @@ public:
     // В случае текстовой ячейки это её текст (без экранирующих символов). В
     // случае формулы - числовое значение формулы или сообщение об ошибке.
     virtual Value GetValue() const = 0;
+    // Возвращает видимое значение ячейки, не копируя текст.
+    virtual ValueView GetValueView() const = 0;
     // Возвращает внутренний текст ячейки, как если бы мы начали её
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
@@ -20,16 +20,25 @@ public:
     explicit Formula(std::string expression)
     : ast_(ParseFormulaAST(std::move(expression))) {
     }
+
+    explicit Formula(const FormulaProgram& program)
+    : ast_(BuildFormulaAST(program)) {
+    }
     
     Value Evaluate(const SheetInterface& sheet) const override {
-        // callback функция для извлечения значения ячейки
-        std::function<CellInterface::Value(Position)> cell_value_getter
+        // callback функция для извлечения значения ячейки. Значение читается
+        // через публичный ValueView (строка не копируется, но вариант
+        // занимает 24 байта, а не 8, как CellValue): SheetInterface не даёт
+        // доступа к кэшу таблицы, поэтому вычисление по дереву ещё не
+        // переведено на CellValue. Кэши, теневые столбцы и ColumnKernel уже
+        // работают с 8-байтовыми значениями
+        std::function<CellInterface::ValueView(Position)> cell_value_getter
             = [&sheet](Position pos) {
                 const CellInterface* cell_ = sheet.GetCell(pos);
                 if (!cell_) { 
-                    return CellInterface::Value{0.0};
+                    return CellInterface::ValueView{0.0};
                 }
-                return cell_->GetValue();
+                return cell_->GetValueView();
             };
         try {
             return ast_.Execute(cell_value_getter);
@@ -43,19 +52,88 @@ public:
         return oss.str();
     }
 
-    std::vector<Position> GetReferencedCells() const {
-        auto list_of_cells = ast_.GetCells();
-        std::vector<Position> cells = {list_of_cells.begin(), list_of_cells.end()};
-        auto it = std::unique(cells.begin(), cells.end());
-        cells.erase(it, cells.end());
-        return cells;
+    std::vector<Position> GetReferencedCells() const override {
+        const std::vector<Position>& cells = ast_.GetReferencedCells();
+        return {cells.begin(), cells.end()};
+    }
+
+    PositionSpan GetReferencedCellsView() const override {
+        return ast_.GetReferencedCells();
+    }
+
+    const FormulaProgram& GetProgram() const override {
+        return ast_.GetProgram();
+    }
+
+    HandlingResult HandleInsertedRows(int before, int count) override {
+        return UpdateReferences([before, count](Position pos) {
+            return Inserted(pos, &Position::row, before, count);
+        });
+    }
+
+    HandlingResult HandleInsertedCols(int before, int count) override {
+        return UpdateReferences([before, count](Position pos) {
+            return Inserted(pos, &Position::col, before, count);
+        });
+    }
+
+    HandlingResult HandleDeletedRows(int first, int count) override {
+        return UpdateReferences([first, count](Position pos) {
+            return Deleted(pos, &Position::row, first, count);
+        });
+    }
+
+    HandlingResult HandleDeletedCols(int first, int count) override {
+        return UpdateReferences([first, count](Position pos) {
+            return Deleted(pos, &Position::col, first, count);
+        });
     }
 
 private:
     FormulaAST ast_;
+
+    static Position Inserted(Position pos, int Position::*axis, int before, int count) {
+        if (pos.*axis >= before) {
+            pos.*axis += count;
+        }
+        return pos;
+    }
+
+    static Position Deleted(Position pos, int Position::*axis, int first, int count) {
+        if (pos.*axis >= first + count) {
+            pos.*axis -= count;
+        } else if (pos.*axis >= first) {
+            return Position::NONE;
+        }
+        return pos;
+    }
+
+    HandlingResult UpdateReferences(const std::function<Position(Position)>& update) {
+        // Ссылки, которые не сдвигаются, формулу не меняют
+        const std::vector<Position>& cells = ast_.GetReferencedCells();
+        bool renamed = false;
+        bool changed = false;
+        for (Position pos : cells) {
+            const Position updated = update(pos);
+            if (!updated.IsValid()) {
+                changed = true;
+            } else if (!(updated == pos)) {
+                renamed = true;
+            }
+        }
+        if (!renamed && !changed) {
+            return HandlingResult::NothingChanged;
+        }
+        ast_.UpdateReferences(update);
+        return changed ? HandlingResult::ReferencesChanged : HandlingResult::ReferencesRenamedOnly;
+    }
 };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(const FormulaProgram& program) {
+    return std::make_unique<Formula>(program);
+}
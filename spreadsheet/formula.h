@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "formula_program.h"
 
 #include <memory>
 #include <vector>
@@ -34,8 +35,37 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Тот же список без копирования: он хранится в формуле и действителен,
+    // пока жива формула.
+    virtual PositionSpan GetReferencedCellsView() const = 0;
+
+    // Формула в постфиксной записи с абсолютными ссылками на ячейки.
+    virtual const FormulaProgram& GetProgram() const = 0;
+
+    // Результат изменения ссылок формулы при вставке или удалении строк и
+    // столбцов
+    enum class HandlingResult {
+        NothingChanged,         // ссылки не изменились
+        ReferencesRenamedOnly,  // ссылки сдвинулись вслед за ячейками
+        ReferencesChanged,      // ссылка на удалённую ячейку стала #REF!
+    };
+
+    // Сдвигают ссылки на ячейки при вставке count строк (столбцов) перед
+    // строкой (столбцом) before и при удалении count строк (столбцов),
+    // начиная с first. Ссылки на удалённые ячейки и на ячейки, сдвинутые за
+    // пределы таблицы, становятся ошибкой #REF!. Формула изменяется на
+    // месте, без разбора текста.
+    virtual HandlingResult HandleInsertedRows(int before, int count = 1) = 0;
+    virtual HandlingResult HandleInsertedCols(int before, int count = 1) = 0;
+    virtual HandlingResult HandleDeletedRows(int first, int count = 1) = 0;
+    virtual HandlingResult HandleDeletedCols(int first, int count = 1) = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Строит формулу по её программе (см. FormulaInterface::GetProgram) без
+// разбора текста. Бросает FormulaException, если программа некорректна.
+std::unique_ptr<FormulaInterface> MakeFormula(const FormulaProgram& program);
@@ -0,0 +1,24 @@
+#include "formula_program.h"
+
+#include <charconv>
+
+std::variant<double, FormulaError> ToFormulaArgument(CellInterface::ValueView value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<FormulaError>(value)) {
+        return std::get<FormulaError>(value);
+    }
+
+    // Строку нужно привести к double
+    std::string_view str = std::get<std::string_view>(value);
+    if (str.empty()) {
+        return 0.0;
+    }
+    double numeric_value = 0.0;
+    auto result = std::from_chars(str.data(), str.data() + str.size(), numeric_value);
+    if (result.ec == std::errc() && result.ptr == str.data() + str.size()) {
+        return numeric_value;
+    }
+    return FormulaError(FormulaError::Category::Value);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <variant>
+#include <vector>
+
+// Формула в постфиксной записи. Команды выполняются по порядку над стеком
+// чисел, и этот порядок совпадает с порядком вычисления выражения, поэтому
+// первая возникшая ошибка та же, что и при вычислении по дереву.
+struct FormulaInstruction {
+    enum class Code : std::uint8_t {
+        Number,    // положить на стек number
+        Cell,      // положить на стек значение ячейки cell
+        RefError,  // ссылка на некорректную позицию: ошибка #REF!
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        Plus,      // унарный плюс: значение не меняется
+    };
+
+    Code code = Code::Number;
+    double number = 0.0;
+    Position cell;
+};
+
+using FormulaProgram = std::vector<FormulaInstruction>;
+
+// Делитель, меньший по модулю, считается нулём.
+constexpr double DIVISION_EPSILON = 1.e-30;
+
+// Приводит значение ячейки, на которую ссылается формула, к числу. Пустой
+// текст - ноль, текст, не являющийся числом, - ошибка #VALUE!, ошибка
+// ячейки возвращается как есть.
+std::variant<double, FormulaError> ToFormulaArgument(CellInterface::ValueView value);
@@ -0,0 +1,187 @@
+#include "frozen_sheet.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std::literals;
+
+CellInterface::ValueView FrozenSheet::GetValue(Position pos) const {
+    const std::uint32_t index = Find(pos);
+    if (index == NO_CELL) {
+        return ""sv;
+    }
+    return values_[index].ToView();
+}
+
+std::string_view FrozenSheet::GetText(Position pos) const {
+    const std::uint32_t index = Find(pos);
+    if (index == NO_CELL) {
+        return ""sv;
+    }
+    return GetTextById(texts_[index]);
+}
+
+Size FrozenSheet::GetPrintableSize() const {
+    return size_;
+}
+
+std::size_t FrozenSheet::GetCellCount() const {
+    return values_.size();
+}
+
+std::size_t FrozenSheet::GetMemoryUsage() const {
+    std::size_t usage = rows_.capacity() * sizeof(RowIndex)
+        + cols_.capacity() * sizeof(std::uint16_t) + values_.capacity() * sizeof(CellValue)
+        + strings_.capacity() * sizeof(std::string) + texts_.capacity() * sizeof(std::uint32_t)
+        + text_offsets_.capacity() * sizeof(std::uint32_t) + text_data_.capacity();
+    for (const std::string& str : strings_) {
+        // Короткие строки хранятся внутри объекта std::string
+        if (str.capacity() >= sizeof(std::string)) {
+            usage += str.capacity() + 1;
+        }
+    }
+    return usage;
+}
+
+std::uint32_t FrozenSheet::Find(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position: row = "s + std::to_string(pos.row)
+            + ", col = "s + std::to_string(pos.col));
+    }
+    if (pos.row >= size_.rows) {
+        return NO_CELL;
+    }
+    const RowIndex& row = rows_[pos.row];
+    const unsigned col = static_cast<unsigned>(pos.col - row.first_col);
+    if (row.span > 0) {
+        return col < row.span ? row.offset + col : NO_CELL;
+    }
+    const auto begin = cols_.begin() + row.offset;
+    const auto end = cols_.begin() + rows_[pos.row + 1].offset;
+    const auto it = std::lower_bound(begin, end, pos.col);
+    if (it == end || *it != pos.col) {
+        return NO_CELL;
+    }
+    return static_cast<std::uint32_t>(it - cols_.begin());
+}
+
+std::string_view FrozenSheet::GetTextById(std::uint32_t id) const {
+    return std::string_view(text_data_).substr(text_offsets_[id],
+                                               text_offsets_[id + 1] - text_offsets_[id]);
+}
+
+template <typename Printer>
+void FrozenSheet::PrintCells(std::ostream& output, Printer print) const {
+    for (int row = 0; row < size_.rows; ++row) {
+        int column = 0;
+        for (std::uint32_t i = rows_[row].offset; i < rows_[row + 1].offset; ++i) {
+            for (; column < cols_[i]; ++column) {
+                output << '\t';
+            }
+            print(i);
+        }
+        for (; column + 1 < size_.cols; ++column) {
+            output << '\t';
+        }
+        output << '\n';
+    }
+}
+
+void FrozenSheet::PrintValues(std::ostream& output) const {
+    PrintCells(output, [&](std::uint32_t index) {
+        const CellValue value = values_[index];
+        if (value.IsNumber()) {
+            WriteNumber(output, value.AsNumber(), number_format_);
+        } else if (value.IsError()) {
+            output << value.AsError();
+        } else {
+            output << value.AsString();
+        }
+    });
+}
+
+void FrozenSheet::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [&](std::uint32_t index) {
+        output << GetTextById(texts_[index]);
+    });
+}
+
+void FrozenSheet::Builder::AddCell(Position pos, CellValue value, std::string_view text) {
+    assert(pos.IsValid() && !value.IsNone());
+    assert(pos.row > last_.row || (pos.row == last_.row && pos.col > last_.col));
+    last_ = pos;
+
+    // Начала строк заполняются при сборке: пока строка r хранит номер своей
+    // первой ячейки, остальные - NO_CELL
+    auto& rows = sheet_.rows_;
+    if (static_cast<int>(rows.size()) <= pos.row) {
+        rows.resize(pos.row + 1, {NO_CELL, 0, 0});
+        rows[pos.row].offset = static_cast<std::uint32_t>(sheet_.values_.size());
+    }
+
+    sheet_.cols_.push_back(static_cast<std::uint16_t>(pos.col));
+    sheet_.texts_.push_back(texts_.Intern(text));
+    if (value.IsString()) {
+        string_values_.push_back(strings_.Intern(value.AsString()));
+        sheet_.values_.push_back(CellValue());
+    } else {
+        string_values_.push_back(NO_CELL);
+        sheet_.values_.push_back(value);
+    }
+}
+
+FrozenSheet FrozenSheet::Builder::Build(Size size, NumberFormat number_format) {
+    assert(last_.row < size.rows && last_.col < size.cols);
+    sheet_.size_ = size;
+    sheet_.number_format_ = number_format;
+
+    auto& rows = sheet_.rows_;
+    rows.resize(size.rows + 1, {NO_CELL, 0, 0});
+    std::uint32_t next = static_cast<std::uint32_t>(sheet_.values_.size());
+    for (int row = size.rows; row >= 0; --row) {
+        if (rows[row].offset == NO_CELL) {
+            rows[row].offset = next;
+        }
+        next = rows[row].offset;
+    }
+    for (int row = 0; row < size.rows; ++row) {
+        const std::uint32_t begin = rows[row].offset;
+        const std::uint32_t end = rows[row + 1].offset;
+        if (begin == end) {
+            continue;
+        }
+        rows[row].first_col = sheet_.cols_[begin];
+        const int span = sheet_.cols_[end - 1] - sheet_.cols_[begin] + 1;
+        if (span == static_cast<int>(end - begin)) {
+            rows[row].span = static_cast<std::uint16_t>(span);
+        }
+    }
+
+    sheet_.strings_.assign(std::make_move_iterator(strings_.strings.begin()),
+                           std::make_move_iterator(strings_.strings.end()));
+    for (std::size_t i = 0; i < string_values_.size(); ++i) {
+        if (string_values_[i] != NO_CELL) {
+            sheet_.values_[i] = CellValue::String(&sheet_.strings_[string_values_[i]]);
+        }
+    }
+    sheet_.text_offsets_.push_back(0);
+    for (const std::string& text : texts_.strings) {
+        sheet_.text_data_ += text;
+        sheet_.text_offsets_.push_back(static_cast<std::uint32_t>(sheet_.text_data_.size()));
+    }
+
+    sheet_.cols_.shrink_to_fit();
+    sheet_.values_.shrink_to_fit();
+    sheet_.texts_.shrink_to_fit();
+    return std::move(sheet_);
+}
+
+std::uint32_t FrozenSheet::Builder::StringTable::Intern(std::string_view str) {
+    auto it = ids.find(str);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    const auto id = static_cast<std::uint32_t>(strings.size());
+    ids.emplace(strings.emplace_back(str), id);
+    return id;
+}
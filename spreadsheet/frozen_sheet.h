@@ -0,0 +1,110 @@
+#pragma once
+
+#include "cell_value.h"
+#include "common.h"
+#include "number_format.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Неизменяемая таблица для чтения (см. Sheet::Freeze). Хранит только
+// значения и тексты непустых ячеек: по строкам в формате CSR, значения -
+// плотным массивом CellValue, строки значений - один раз в массиве строк,
+// тексты ячеек - один раз в общем буфере. Графа зависимостей, кэшей и объектов ячеек нет, поэтому
+// все методы можно вызывать из нескольких потоков без блокировок.
+//
+// Таблица только перемещается: значения ссылаются на её строки.
+class FrozenSheet {
+public:
+    class Builder;
+
+    FrozenSheet(const FrozenSheet&) = delete;
+    FrozenSheet& operator=(const FrozenSheet&) = delete;
+    FrozenSheet(FrozenSheet&&) = default;
+    FrozenSheet& operator=(FrozenSheet&&) = default;
+
+    // Значение ячейки: пустая строка для пустой ячейки. Бросает
+    // InvalidPositionException для некорректной позиции
+    CellInterface::ValueView GetValue(Position pos) const;
+    // Текст ячейки, как в Sheet::GetCell(pos)->GetText()
+    std::string_view GetText(Position pos) const;
+
+    Size GetPrintableSize() const;
+    // Число непустых ячеек
+    std::size_t GetCellCount() const;
+    // Память, занятая данными таблицы, в байтах
+    std::size_t GetMemoryUsage() const;
+
+    // Вывод совпадает с Sheet::PrintValues/PrintTexts исходной таблицы
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+private:
+    // Отрезок строки в массивах ячеек. Если столбцы строки идут подряд
+    // (span > 0), ячейка находится по индексу без поиска
+    struct RowIndex {
+        std::uint32_t offset = 0;
+        std::uint16_t first_col = 0;
+        std::uint16_t span = 0;
+    };
+
+    static constexpr std::uint32_t NO_CELL = UINT32_MAX;
+
+    FrozenSheet() = default;
+
+    std::uint32_t Find(Position pos) const;
+
+    template <typename Printer>
+    void PrintCells(std::ostream& output, Printer print) const;
+
+    Size size_;
+    NumberFormat number_format_ = NumberFormat::Shortest;
+
+    // rows_[r] - строка r, rows_[size_.rows] - конец массивов ячеек
+    std::vector<RowIndex> rows_;
+    std::vector<std::uint16_t> cols_;
+    std::vector<CellValue> values_;
+    std::vector<std::string> strings_;
+
+    // Номер текста ячейки; текст с номером i занимает в text_data_ отрезок
+    // [text_offsets_[i], text_offsets_[i + 1])
+    std::vector<std::uint32_t> texts_;
+    std::vector<std::uint32_t> text_offsets_;
+    std::string text_data_;
+
+    std::string_view GetTextById(std::uint32_t id) const;
+};
+
+// Собирает FrozenSheet из ячеек, добавленных в порядке строк, а внутри
+// строки - в порядке столбцов. Build вызывается один раз
+class FrozenSheet::Builder {
+public:
+    // value - вычисленное значение ячейки, строки копируются
+    void AddCell(Position pos, CellValue value, std::string_view text);
+
+    FrozenSheet Build(Size size, NumberFormat number_format);
+
+private:
+    // Различные строки в порядке добавления. deque не перемещает строки, и
+    // ключи ids остаются действительными
+    struct StringTable {
+        std::deque<std::string> strings;
+        std::unordered_map<std::string_view, std::uint32_t> ids;
+
+        std::uint32_t Intern(std::string_view str);
+    };
+
+    FrozenSheet sheet_;
+    StringTable strings_;
+    StringTable texts_;
+    // Номер строки значения для каждой ячейки (или NO_CELL): значения-строки
+    // получают адреса при сборке
+    std::vector<std::uint32_t> string_values_;
+    Position last_ = {-1, -1};
+};
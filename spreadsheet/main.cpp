@@ -1,7 +1,19 @@
+#include <cmath>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
 #include <limits>
+#include <sstream>
+#include <string_view>
 
+#include "arrow_export.h"
+#include "cell_value.h"
 #include "common.h"
 #include "formula.h"
+#include "number_format.h"
+#include "position_key.h"
+#include "replication.h"
+#include "sheet.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -25,6 +37,15 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::ValueView& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
 namespace {
 
 void TestPositionAndStringConversion() {
@@ -50,7 +71,8 @@ void TestPositionAndStringConversion() {
     testSingle(Position{0, 701}, "ZZ1");
     testSingle(Position{0, 702}, "AAA1");
     testSingle(Position{136, 2}, "C137");
-    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+    testSingle(Position{16383, 16383}, "XFD16384");
+    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD1048576");
 }
 
 void TestPositionToStringInvalid() {
@@ -69,12 +91,26 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("A+1").IsValid());
     ASSERT(!Position::FromString("R2D2").IsValid());
     ASSERT(!Position::FromString("C3PO").IsValid());
-    ASSERT(!Position::FromString("XFD16385").IsValid());
+    ASSERT(!Position::FromString("XFD1048577").IsValid());
     ASSERT(!Position::FromString("XFE16384").IsValid());
+    ASSERT(!Position::FromString("A99999999999").IsValid());
     ASSERT(!Position::FromString("A1234567890123456789").IsValid());
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
 }
 
+void TestPositionKey() {
+    for (Position pos : {Position{0, 0}, Position{1, 0}, Position{0, 1}, Position{136, 2},
+                         Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}}) {
+        ASSERT_EQUAL(FromKey(ToKey(pos)), pos);
+    }
+    // Ячейки квадрата 2x2 получают последовательные ключи
+    ASSERT_EQUAL(ToKey({0, 0}), 0u);
+    ASSERT_EQUAL(ToKey({0, 1}), 1u);
+    ASSERT_EQUAL(ToKey({1, 0}), 2u);
+    ASSERT_EQUAL(ToKey({1, 1}), 3u);
+    ASSERT(ToKey({Position::MAX_ROWS - 1, Position::MAX_COLS - 1}) > 0xFFFFFFFFull);
+}
+
 void TestEmpty() {
     auto sheet = CreateSheet();
     ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
@@ -121,6 +157,899 @@ void TestSetCellPlainText() {
     ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
 }
 
+void TestValueView() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "'=escaped");
+    sheet->SetCell("A2"_pos, "=1/0");
+    sheet->SetCell("A3"_pos, "12");
+    sheet->SetCell("A4"_pos, "=A3*2");
+
+    const CellInterface* text = sheet->GetCell("A1"_pos);
+    auto view = std::get<std::string_view>(text->GetValueView());
+    ASSERT_EQUAL(view, "=escaped");
+    // Повторное чтение не копирует строку
+    ASSERT(std::get<std::string_view>(text->GetValueView()).data() == view.data());
+
+    ASSERT_EQUAL(std::get<FormulaError>(sheet->GetCell("A2"_pos)->GetValueView()),
+                 FormulaError(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("A4"_pos)->GetValueView()), 24.0);
+}
+
+void TestCellValue() {
+    ASSERT(CellValue().IsNone());
+    ASSERT(!CellValue().IsNumber());
+
+    CellValue number = CellValue::Number(-2.5);
+    ASSERT(number.IsNumber() && !number.IsNone() && !number.IsError() && !number.IsString());
+    ASSERT_EQUAL(number.AsNumber(), -2.5);
+    ASSERT(!(CellValue::Number(0.0) == CellValue::Number(-0.0)));
+    ASSERT(CellValue::Number(std::numeric_limits<double>::infinity()).IsNumber());
+    ASSERT(CellValue::Number(-std::numeric_limits<double>::quiet_NaN()).IsNumber());
+
+    for (auto category : {FormulaError::Category::Ref, FormulaError::Category::Value,
+                          FormulaError::Category::Arithmetic}) {
+        CellValue error = CellValue::Error(category);
+        ASSERT(error.IsError() && !error.IsNumber());
+        ASSERT_EQUAL(error.AsError(), FormulaError(category));
+        ASSERT_EQUAL(error.ToValue(), CellInterface::Value(FormulaError(category)));
+    }
+
+    const std::string lhs = "text";
+    const std::string rhs = "text";
+    CellValue str = CellValue::String(&lhs);
+    ASSERT(str.IsString());
+    ASSERT_EQUAL(str.AsString(), "text");
+    ASSERT(str == CellValue::String(&rhs));
+    ASSERT(!(str == CellValue::Number(0.0)));
+    ASSERT_EQUAL(str.ToValue(), CellInterface::Value(std::string("text")));
+}
+
+void TestStringPool() {
+    StringPool pool;
+    StringPool::Id usd = pool.Acquire("USD");
+    ASSERT_EQUAL(pool.Acquire("USD"), usd);
+    StringPool::Id na = pool.Acquire("N/A");
+    ASSERT(na != usd);
+    ASSERT_EQUAL(pool.Get(usd), "USD");
+    ASSERT_EQUAL(pool.Size(), 2u);
+
+    pool.Release(usd);
+    ASSERT_EQUAL(pool.Get(usd), "USD");
+    pool.Release(usd);
+    ASSERT_EQUAL(pool.Size(), 1u);
+    // Освобождённый идентификатор используется повторно
+    ASSERT_EQUAL(pool.Acquire("EUR"), usd);
+    ASSERT_EQUAL(pool.Get(na), "N/A");
+
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+        sheet.SetCell({row, 0}, row % 2 ? "USD" : "'USD");
+    }
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 1u);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "'USD");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "USD");
+    // Значения одинаковых строк ссылаются на одну запись пула
+    ASSERT(std::get<std::string_view>(sheet.GetCell("A1"_pos)->GetValueView()).data()
+           == std::get<std::string_view>(sheet.GetCell("A2"_pos)->GetValueView()).data());
+
+    sheet.SetCell("A1"_pos, "EUR");
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 2u);
+    sheet.ClearRange({"A1"_pos, {1000, 1}});
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 0u);
+}
+
+void TestNumberFormat() {
+    const double numbers[] = {0.0, -0.0, 1.0, 35.0, -2.5, 0.1, 1.0 / 3, 0.1 + 0.2, 123456.0,
+                              1234567.0, 1e-5, 1e21, -1.7976931348623157e308, 5e-324};
+    for (double number : numbers) {
+        // Кратчайшая запись читается как то же число
+        ASSERT_EQUAL(std::strtod(FormatNumber(number).c_str(), nullptr), number);
+
+        // Совместимая запись совпадает с operator<< при любой точности
+        for (int precision : {0, 3, 6, 17}) {
+            std::ostringstream expected;
+            expected.precision(precision);
+            expected << number;
+            std::ostringstream actual;
+            actual.precision(precision);
+            WriteNumber(actual, number, NumberFormat::Stream);
+            ASSERT_EQUAL(actual.str(), expected.str());
+        }
+    }
+    ASSERT_EQUAL(FormatNumber(0.1 + 0.2), "0.30000000000000004");
+    ASSERT_EQUAL(FormatNumber(1e21), "1e+21");
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1/3");
+    std::ostringstream shortest;
+    sheet.PrintValues(shortest);
+    ASSERT_EQUAL(shortest.str(), "0.3333333333333333\n");
+
+    sheet.SetNumberFormat(NumberFormat::Stream);
+    std::ostringstream stream;
+    sheet.PrintValues(stream);
+    ASSERT_EQUAL(stream.str(), "0.333333\n");
+}
+
+void TestParallelExport() {
+    Sheet sheet;
+    // Больше строк, чем в нескольких отрезках вывода, с пропусками строк и
+    // столбцов, текстом, ошибками и невычисленными формулами
+    for (int row = 0; row < 5000; ++row) {
+        if (row % 7 == 3) {
+            continue;
+        }
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 2}, row % 11 ? "=A" + r + "/3" : "=A" + r + "/0");
+        if (row % 5 == 0) {
+            sheet.SetCell({row, 4}, "'=text" + r);
+        }
+        // Формулы вне векторных блоков: цепочка через отрезки вывода по
+        // своему столбцу, формулы без ссылок и одиночные ссылки на другой
+        // отрезок
+        sheet.SetCell({row, 6}, row < 1500 ? "=A" + r : "=G" + std::to_string(row - 1499) + "+1");
+        sheet.SetCell({row, 7}, "=" + std::to_string(row) + "*2");
+        if (row % 97 == 0) {
+            sheet.SetCell({row, 8}, "=A" + std::to_string((row + 2500) % 5000 + 1) + "*2");
+        }
+    }
+    sheet.SetCell("A1"_pos, "1");
+
+    for (auto mode : {RecalculationMode::Lazy, RecalculationMode::Epoch, RecalculationMode::Lazy}) {
+        sheet.SetRecalculationMode(mode);
+        // Изменения в разных отрезках оставляют кэш зависимых формул
+        // невычисленным
+        sheet.SetCell("A2"_pos, "10");
+        sheet.SetCell("A2502"_pos, "7");
+        sheet.SetCell("A4001"_pos, "=A2+1");
+        for (unsigned threads : {1u, 2u, 4u, 0u}) {
+            std::ostringstream values;
+            values.precision(3);
+            sheet.PrintValuesParallel(values, threads);
+            std::ostringstream expected_values;
+            expected_values.precision(3);
+            sheet.PrintValues(expected_values);
+            ASSERT_EQUAL(values.str(), expected_values.str());
+
+            std::ostringstream texts;
+            sheet.PrintTextsParallel(texts, threads);
+            std::ostringstream expected_texts;
+            sheet.PrintTexts(expected_texts);
+            ASSERT_EQUAL(texts.str(), expected_texts.str());
+        }
+    }
+}
+
+void TestFrozenSheet() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1/3");
+    sheet.SetCell("C1"_pos, "'=text");
+    sheet.SetCell("A3"_pos, "=1/0");
+    sheet.SetCell("E3"_pos, "=Z10");
+    sheet.SetCell("B4"_pos, "=A1+C1");
+    sheet.SetCell("D4"_pos, "text");
+    sheet.SetCell("F5"_pos, "text");
+
+    // Перемещение не меняет значений, ссылающихся на строки таблицы
+    FrozenSheet moved = sheet.Freeze();
+    FrozenSheet frozen = std::move(moved);
+    ASSERT_EQUAL(frozen.GetPrintableSize(), sheet.GetPrintableSize());
+    ASSERT_EQUAL(frozen.GetCellCount(), 8u);
+
+    for (int row = 0; row < 12; ++row) {
+        for (int col = 0; col < 28; ++col) {
+            const Position pos{row, col};
+            const CellInterface* cell = sheet.GetCell(pos);
+            const CellInterface::ValueView value = frozen.GetValue(pos);
+            if (cell == nullptr || cell->GetText().empty()) {
+                ASSERT_EQUAL(value, CellInterface::ValueView(""));
+                ASSERT_EQUAL(frozen.GetText(pos), "");
+            } else {
+                ASSERT_EQUAL(value, cell->GetValueView());
+                ASSERT_EQUAL(frozen.GetText(pos), cell->GetText());
+            }
+        }
+    }
+
+    std::ostringstream frozen_values;
+    frozen.PrintValues(frozen_values);
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(frozen_values.str(), values.str());
+
+    std::ostringstream frozen_texts;
+    frozen.PrintTexts(frozen_texts);
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(frozen_texts.str(), texts.str());
+
+    // Копия не зависит от последующих изменений
+    sheet.SetCell("A1"_pos, "4");
+    sheet.ClearCell("D4"_pos);
+    ASSERT_EQUAL(std::get<double>(frozen.GetValue("B1"_pos)), 1.0 / 3);
+    ASSERT_EQUAL(frozen.GetValue("D4"_pos), CellInterface::ValueView("text"));
+
+    try {
+        frozen.GetValue(Position::NONE);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    ASSERT_EQUAL(Sheet().Freeze().GetPrintableSize(), (Size{0, 0}));
+    ASSERT_EQUAL(Sheet().Freeze().GetValue("A1"_pos), CellInterface::ValueView(""));
+}
+
+void TestGetValues() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "text");
+    sheet.SetCell("A2"_pos, "=B1+B2");
+    sheet.SetCell("C2"_pos, "=1/0");
+    sheet.SetCell("B3"_pos, "'42");
+    sheet.SetCell("C3"_pos, "=C1");
+
+    // Формулы, зависящие друг от друга, вычисляются после изменения
+    sheet.SetCell("A1"_pos, "5");
+
+    const Range range{"A1"_pos, {3, 3}};
+    double numbers[9];
+    ShadowStatus statuses[9];
+    std::string_view strings[9];
+    sheet.GetValues(range, numbers, statuses, strings);
+
+    const ShadowStatus expected_statuses[9] = {
+        ShadowStatus::NumericText, ShadowStatus::Number, ShadowStatus::Text,
+        ShadowStatus::Number, ShadowStatus::Empty, ShadowStatus::ArithmeticError,
+        ShadowStatus::Empty, ShadowStatus::NumericText, ShadowStatus::ValueError};
+    const double expected_numbers[9] = {5, 10, 0, 10, 0, 0, 0, 42, 0};
+    for (int i = 0; i < 9; ++i) {
+        ASSERT(statuses[i] == expected_statuses[i]);
+        ASSERT_EQUAL(numbers[i], expected_numbers[i]);
+    }
+    ASSERT_EQUAL(strings[0], "5");
+    ASSERT_EQUAL(strings[2], "text");
+    ASSERT_EQUAL(strings[7], "42");
+    ASSERT(strings[1].empty() && strings[4].empty());
+
+    // Область, не совпадающая с началом таблицы, без строк
+    double column[2];
+    ShadowStatus column_statuses[2];
+    sheet.GetValues({"B2"_pos, {2, 1}}, column, column_statuses, nullptr);
+    ASSERT(column_statuses[0] == ShadowStatus::Empty);
+    ASSERT(column_statuses[1] == ShadowStatus::NumericText && column[1] == 42);
+
+    try {
+        sheet.GetValues({"A1"_pos, {Position::MAX_ROWS + 1, 1}}, column, column_statuses,
+                        nullptr);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestArrowExport() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1/4");
+    sheet.SetCell("A2"_pos, "hello");
+    sheet.SetCell("A4"_pos, "=1/0");
+    sheet.SetCell("B3"_pos, "'42");
+    sheet.SetCell("B4"_pos, "=B3+A2");
+
+    ArrowSchema schema;
+    ArrowArray array;
+    ExportArrow(sheet, &schema, &array);
+
+    ASSERT_EQUAL(std::string(schema.format), "+s");
+    ASSERT_EQUAL(schema.n_children, 2);
+    ASSERT_EQUAL(array.length, 4);
+    ASSERT_EQUAL(array.n_children, 2);
+    ASSERT_EQUAL(std::string(schema.children[1]->name), "B");
+
+    auto is_valid = [](const ArrowArray* field, int row) {
+        const auto* validity = static_cast<const std::uint8_t*>(field->buffers[0]);
+        return (validity[row / 8] >> (row % 8) & 1) != 0;
+    };
+
+    const ArrowSchema* column_schema = schema.children[0];
+    ASSERT_EQUAL(column_schema->n_children, 3);
+    ASSERT_EQUAL(std::string(column_schema->children[0]->format), "g");
+    ASSERT_EQUAL(std::string(column_schema->children[1]->format), "u");
+    ASSERT_EQUAL(std::string(column_schema->children[2]->format), "c");
+    ASSERT_EQUAL(std::string(column_schema->children[2]->dictionary->format), "u");
+
+    // Столбец A: число, текст, пусто, ошибка
+    const ArrowArray* column = array.children[0];
+    const ArrowArray* number = column->children[0];
+    const ArrowArray* text = column->children[1];
+    const ArrowArray* error = column->children[2];
+    ASSERT_EQUAL(number->null_count, 3);
+    ASSERT(is_valid(number, 0) && !is_valid(number, 1));
+    ASSERT_EQUAL(static_cast<const double*>(number->buffers[1])[0], 0.25);
+
+    ASSERT_EQUAL(text->null_count, 3);
+    ASSERT(is_valid(text, 1) && !is_valid(text, 2));
+    const auto* offsets = static_cast<const std::int32_t*>(text->buffers[1]);
+    const auto* chars = static_cast<const char*>(text->buffers[2]);
+    ASSERT_EQUAL(std::string(chars + offsets[1], offsets[2] - offsets[1]), "hello");
+
+    ASSERT_EQUAL(error->null_count, 3);
+    ASSERT(is_valid(error, 3));
+    const int index = static_cast<const std::int8_t*>(error->buffers[1])[3];
+    const ArrowArray* dictionary = error->dictionary;
+    const auto* names = static_cast<const std::int32_t*>(dictionary->buffers[1]);
+    const auto* name_chars = static_cast<const char*>(dictionary->buffers[2]);
+    ASSERT_EQUAL(std::string(name_chars + names[index], names[index + 1] - names[index]),
+                 "#ARITHM!");
+
+    // Словарь ошибок совпадает с FormulaError::ToString
+    std::vector<std::string> dictionary_names;
+    for (int i = 0; i < dictionary->length; ++i) {
+        dictionary_names.emplace_back(name_chars + names[i], names[i + 1] - names[i]);
+    }
+    ASSERT_EQUAL(dictionary_names, (std::vector<std::string>{"#REF!", "#VALUE", "#ARITHM!"}));
+
+    // Столбец B: текст "42" остаётся текстом, ошибка формулы - #VALUE
+    const ArrowArray* b_error = array.children[1]->children[2];
+    ASSERT(is_valid(array.children[1]->children[1], 2));
+    ASSERT_EQUAL(static_cast<const std::int8_t*>(b_error->buffers[1])[3], 1);
+
+    // Получатель может забрать столбец себе до освобождения выгрузки
+    ArrowArray moved = *array.children[1];
+    array.children[1]->release = nullptr;
+    array.release(&array);
+    ASSERT(array.release == nullptr);
+    ASSERT_EQUAL(moved.length, 4);
+    moved.release(&moved);
+    schema.release(&schema);
+    ASSERT(schema.release == nullptr);
+}
+
+void TestCellStorageValueSlots() {
+    // Кэши значений лежат в блоке хранилища, а не в ячейке
+    static_assert(sizeof(Cell) <= 40);
+
+    Sheet sheet;
+    // Все ячейки A1:B4 попадают в один блок 8x8
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("B1"_pos, "=A2*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    // Новая ячейка занимает слот заменённой со сброшенным кэшем
+    sheet.SetCell("A2"_pos, "=A1+2");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    // Удаление соседней ячейки блока не затрагивает чужие кэши
+    sheet.SetCell("B4"_pos, "text");
+    sheet.ClearCell("B4"_pos);
+    ASSERT(sheet.GetCell("B4"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    // В режиме Eager замена сравнивается со значением прежней ячейки
+    sheet.SetRecalculationMode(RecalculationMode::Eager);
+    sheet.SetCell("A2"_pos, "=1+2");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet.SetCell("A2"_pos, "=A1*5");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(50.0));
+}
+
+void TestSheetDiffMerge() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+
+    Sheet base;
+    base.SetCell("A1"_pos, "1");
+    base.SetCell("A2"_pos, "=A1+1");
+    base.SetCell("C3"_pos, "text");
+    base.SetCell("Z100"_pos, "=A2*2");
+    ASSERT(base.Diff(base).empty());
+
+    Sheet ours;
+    ours.SetCell("A1"_pos, "1");
+    ours.SetCell("A2"_pos, "=A1+1");
+    ours.SetCell("C3"_pos, "text");
+    ours.SetCell("Z100"_pos, "=A2*2");
+    ASSERT(base.Diff(ours).empty());
+
+    // Пустые ячейки-заглушки не отличаются от отсутствующих
+    ours.SetCell("B1"_pos, "=D1");
+    ours.ClearCell("B1"_pos);
+    ours.SetCell("D1"_pos, "");
+    ASSERT(base.Diff(ours).empty());
+
+    ours.SetCell("C3"_pos, "ours");
+    ours.SetCell("B2"_pos, "=1+2");
+    Sheet theirs;
+    theirs.SetCell("A1"_pos, "10");
+    theirs.SetCell("A2"_pos, "=A1+1");
+    theirs.SetCell("C3"_pos, "theirs");
+    theirs.SetCell("Z100"_pos, "=A2*2");
+    theirs.SetCell("B2"_pos, "=1+2");
+    theirs.SetCell("E5"_pos, "=A1+B2");
+
+    auto diff = base.Diff(theirs);
+    ASSERT_EQUAL(diff.size(), 4u);
+    ASSERT(diff[0].pos == "A1"_pos);
+    ASSERT_EQUAL(diff[0].old_text, "1");
+    ASSERT_EQUAL(diff[0].new_text, "10");
+    ASSERT(diff[3].pos == "E5"_pos);
+    ASSERT_EQUAL(diff[3].old_text, "");
+
+    // Z100 зависит от изменённой A1 через A2: кэш сбрасывается при слиянии
+    ASSERT_EQUAL(value(ours, "Z100"_pos), CellInterface::Value(4.0));
+    MergeResult result = ours.Merge(base, theirs);
+    ASSERT_EQUAL(result.applied.size(), 2u);
+    ASSERT_EQUAL(result.conflicts.size(), 1u);
+    ASSERT(result.conflicts[0].pos == "C3"_pos);
+    ASSERT_EQUAL(result.conflicts[0].base_text, "text");
+    ASSERT_EQUAL(result.conflicts[0].our_text, "ours");
+    ASSERT_EQUAL(result.conflicts[0].their_text, "theirs");
+    ASSERT_EQUAL(value(ours, "Z100"_pos), CellInterface::Value(22.0));
+    ASSERT_EQUAL(value(ours, "E5"_pos), CellInterface::Value(13.0));
+    ASSERT_EQUAL(ours.GetCell("C3"_pos)->GetText(), "ours");
+    ASSERT_EQUAL(ours.Diff(theirs).size(), 1u);
+
+    // Изменения, вместе образующие цикл, не применяются ни по одному
+    Sheet sheet;
+    sheet.SetRecalculationMode(RecalculationMode::Eager);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    bool caught = false;
+    try {
+        sheet.SetCells({{"A1"_pos, "=C1"}, {"C1"_pos, "=B1"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos), nullptr);
+    ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(2.0));
+
+    // Ячейки нового набора ссылаются друг на друга в любом порядке
+    sheet.SetCells({{"B1"_pos, "=C1*2"}, {"C1"_pos, "=A1+1"}, {"A1"_pos, "5"}});
+    ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(12.0));
+    sheet.SetCells({{"A1"_pos, ""}, {"C1"_pos, "=A1+3"}});
+    ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "");
+
+    caught = false;
+    try {
+        sheet.SetCells({{"D1"_pos, "1"}, {"D1"_pos, "2"}});
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos), nullptr);
+}
+
+void TestReplication() {
+    // Формула, собранная по программе, совпадает с разобранной
+    for (std::string expr : {"+(A1+B2)*-3", "1/(2-C3)", "-+-4.5", "A1-(B1-C1)"}) {
+        auto parsed = ParseFormula(expr);
+        auto built = MakeFormula(parsed->GetProgram());
+        ASSERT_EQUAL(built->GetExpression(), parsed->GetExpression());
+        ASSERT_EQUAL(built->GetReferencedCells(), parsed->GetReferencedCells());
+    }
+    FormulaProgram broken(1);
+    broken[0].code = FormulaInstruction::Code::Add;
+    bool caught = false;
+    try {
+        MakeFormula(broken);
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    std::stringstream channel;
+    Sheet leader;
+    ReplicationLog log(channel);
+    leader.SetReplicationLog(&log);
+    Sheet replica;
+    ReplicaReader reader(replica, channel);
+
+    leader.SetCell("A1"_pos, "2");
+    leader.SetCell("B1"_pos, "=+(A1+C1)*-3");
+    leader.SetCell("C1"_pos, "'=text");
+    caught = false;
+    try {
+        leader.SetCell("C1"_pos, "=B1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(log.GetVersion(), 3u);
+    log.Flush();
+
+    // Второй пакет: две правки подряд одной ячейки и очистка области
+    leader.SetCells({{"A2"_pos, "=A1*10"}, {"B2"_pos, "x"}});
+    leader.SetCell("A1"_pos, "3");
+    leader.ClearRange({"B2"_pos, {1, 1}});
+    leader.SetCell("C1"_pos, "1");
+    log.Flush();
+    ASSERT_EQUAL(log.GetVersion(), 7u);
+
+    ASSERT(reader.ApplyBatch());
+    ASSERT_EQUAL(reader.GetVersion(), 3u);
+    ASSERT_EQUAL(replica.GetCell("B1"_pos)->GetText(), "=+(A1+C1)*-3");
+    ASSERT_EQUAL(replica.GetCell("B1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+    ASSERT(reader.CatchUp(7));
+    ASSERT(!reader.ApplyBatch());
+    ASSERT(replica.Diff(leader).empty());
+    ASSERT_EQUAL(replica.GetCell("B1"_pos)->GetValue(), CellInterface::Value(-12.0));
+    ASSERT_EQUAL(replica.GetCell("A2"_pos)->GetValue(), CellInterface::Value(30.0));
+    ASSERT_EQUAL(replica.GetCell("B2"_pos), nullptr);
+
+    // Оборванный пакет не применяется
+    // Чтение до конца потока выставило флаги ошибки, запись с ними не идёт
+    channel.clear();
+    const std::size_t flushed = channel.str().size();
+    leader.SetCell("D1"_pos, "=A1");
+    log.Flush();
+    std::string batch = channel.str().substr(flushed);
+    std::istringstream truncated(batch.substr(0, batch.size() - 1));
+    ReplicaReader truncated_reader(replica, truncated);
+    caught = false;
+    try {
+        truncated_reader.ApplyBatch();
+    } catch (const ReplicationException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(replica.GetCell("D1"_pos), nullptr);
+    ASSERT(reader.ApplyBatch());
+
+    // Пустая ячейка SetCell остаётся и на реплике, а очищенная через SetCells
+    // ячейка без зависимых удаляется, как на ведущей таблице
+    leader.SetCell("E1"_pos, "x");
+    leader.SetCell("E2"_pos, "y");
+    leader.SetCell("E3"_pos, "z");
+    leader.SetCell("E1"_pos, "");
+    leader.SetCells({{"E2"_pos, ""}, {"E4"_pos, "w"}});
+    leader.SetCell("E3"_pos, "");
+    leader.ClearCell("E3"_pos);
+    log.Flush();
+    ASSERT(reader.ApplyBatch());
+    ASSERT(replica.Diff(leader).empty());
+    for (Position pos : {"E1"_pos, "E2"_pos, "E3"_pos, "E4"_pos}) {
+        ASSERT_EQUAL(replica.GetCell(pos) == nullptr, leader.GetCell(pos) == nullptr);
+    }
+    ASSERT_EQUAL(replica.GetCell("E1"_pos)->GetValue(), CellInterface::Value(std::string()));
+}
+
+void TestUndoRedo() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetUndoLimit(3);
+    ASSERT(!sheet.CanUndo());
+    ASSERT(!sheet.Undo());
+
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCells({{"C1"_pos, "=B1+1"}, {"A1"_pos, "'text"}});
+    ASSERT_EQUAL(value(sheet, "C1"_pos),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+    // Отмена восстанавливает ячейки и сбрасывает кэш зависимых
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos), nullptr);
+    ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(10.0));
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(2.0));
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos), nullptr);
+    ASSERT(!sheet.CanUndo());
+
+    ASSERT(sheet.Redo());
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*2");
+
+    // Очистка области отменяется одним изменением
+    sheet.ClearRange({"A1"_pos, {1, 2}});
+    ASSERT(!sheet.CanRedo());
+    ASSERT(sheet.GetPrintableSize() == (Size{0, 0}));
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(10.0));
+    ASSERT(sheet.Redo());
+    ASSERT(sheet.GetPrintableSize() == (Size{0, 0}));
+
+    // История ограничена
+    for (int i = 0; i < 5; ++i) {
+        sheet.SetCell("D1"_pos, std::to_string(i));
+    }
+    int undone = 0;
+    while (sheet.Undo()) {
+        ++undone;
+    }
+    ASSERT_EQUAL(undone, 3);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "1");
+
+    sheet.SetUndoLimit(0);
+    sheet.SetCell("D1"_pos, "x");
+    ASSERT(!sheet.CanUndo() && !sheet.CanRedo());
+
+    // Отмена и повтор восстанавливают пустые ячейки, оставленные SetCell, и
+    // не оставляют их там, где ячеек не было
+    Sheet history;
+    history.SetUndoLimit(10);
+    auto snapshot = [&history]() {
+        std::vector<std::string> cells;
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                const CellInterface* cell = history.GetCell({row, col});
+                cells.push_back(cell ? "[" + cell->GetText() + "]" : "-");
+            }
+        }
+        const Size size = history.GetPrintableSize();
+        cells.push_back(std::to_string(size.rows) + "x" + std::to_string(size.cols));
+        return cells;
+    };
+    std::vector<std::vector<std::string>> states{snapshot()};
+    history.SetCell("A1"_pos, "1");
+    states.push_back(snapshot());
+    history.SetCell("B2"_pos, "");
+    states.push_back(snapshot());
+    history.SetCell("A1"_pos, "");
+    states.push_back(snapshot());
+    history.SetCells({{"C3"_pos, "=D3"}, {"B2"_pos, "x"}, {"A1"_pos, "2"}});
+    states.push_back(snapshot());
+    history.ClearRange({"A1"_pos, {2, 2}});
+    states.push_back(snapshot());
+    ASSERT(history.GetCell("B2"_pos) == nullptr);
+
+    for (std::size_t i = states.size() - 1; i > 0; --i) {
+        ASSERT(history.Undo());
+        ASSERT_EQUAL(snapshot(), states[i - 1]);
+    }
+    for (std::size_t i = 1; i < states.size(); ++i) {
+        ASSERT(history.Redo());
+        ASSERT_EQUAL(snapshot(), states[i]);
+    }
+}
+
+void TestInsertDeleteLines() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    auto text = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetText();
+    };
+    const CellInterface::Value ref_error(FormulaError(FormulaError::Category::Ref));
+
+    // Ссылки формулы сдвигаются на месте, формула не разбирается заново
+    auto formula = ParseFormula("A1+B3*C2");
+    using HandlingResult = FormulaInterface::HandlingResult;
+    ASSERT(formula->HandleInsertedRows(5) == HandlingResult::NothingChanged);
+    ASSERT(formula->HandleInsertedRows(1, 2) == HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(formula->GetExpression(), "A1+B5*C4");
+    ASSERT(formula->HandleDeletedCols(1) == HandlingResult::ReferencesChanged);
+    ASSERT_EQUAL(formula->GetExpression(), "A1+#REF!*B4");
+    ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"A1"_pos, "B4"_pos}));
+    ASSERT_EQUAL(MakeFormula(formula->GetProgram())->GetExpression(), formula->GetExpression());
+
+    std::stringstream channel;
+    ReplicationLog log(channel);
+    Sheet replica;
+    ReplicaReader reader(replica, channel);
+
+    Sheet sheet;
+    sheet.SetReplicationLog(&log);
+    sheet.SetUndoLimit(10);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "=A2*10");
+    sheet.SetCell("C1"_pos, "=B2");
+    ASSERT_EQUAL(value(sheet, "C1"_pos), CellInterface::Value(20.0));
+
+    // Вставка строки сдвигает ячейки и ссылки, значения не меняются
+    sheet.InsertRows(1);
+    ASSERT(!sheet.CanUndo());
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos), nullptr);
+    ASSERT_EQUAL(text(sheet, "A3"_pos), "2");
+    ASSERT_EQUAL(text(sheet, "B1"_pos), "=A1+A3");
+    ASSERT_EQUAL(text(sheet, "B3"_pos), "=A3*10");
+    ASSERT_EQUAL(text(sheet, "C1"_pos), "=B3");
+    ASSERT_EQUAL(value(sheet, "C1"_pos), CellInterface::Value(20.0));
+    ASSERT(sheet.GetPrintableSize() == (Size{3, 3}));
+    sheet.SetCell("A3"_pos, "4");
+    ASSERT_EQUAL(value(sheet, "C1"_pos), CellInterface::Value(40.0));
+
+    // Удаление строки: ссылки на удалённые ячейки становятся #REF!, зависимые
+    // пересчитываются
+    sheet.DeleteRows(2);
+    ASSERT_EQUAL(text(sheet, "B1"_pos), "=A1+#REF!");
+    ASSERT_EQUAL(value(sheet, "B1"_pos), ref_error);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos), nullptr);
+    ASSERT_EQUAL(text(sheet, "C1"_pos), "=#REF!");
+    ASSERT_EQUAL(value(sheet, "C1"_pos), ref_error);
+    ASSERT(sheet.GetPrintableSize() == (Size{1, 3}));
+
+    // Столбцы
+    sheet.SetCell("A2"_pos, "=C1");
+    sheet.SetCell("C2"_pos, "=A1*3");
+    sheet.InsertCols(0, 2);
+    ASSERT_EQUAL(text(sheet, "C2"_pos), "=E1");
+    ASSERT_EQUAL(text(sheet, "E2"_pos), "=C1*3");
+    ASSERT_EQUAL(value(sheet, "E2"_pos), CellInterface::Value(3.0));
+    sheet.DeleteCols(0, 3);
+    ASSERT_EQUAL(text(sheet, "B2"_pos), "=#REF!*3");
+    ASSERT_EQUAL(value(sheet, "B2"_pos), ref_error);
+    ASSERT(sheet.GetPrintableSize() == (Size{2, 2}));
+
+    // Тексты с #REF! разбираются заново: таблицу можно восстановить по
+    // текстам и слить с ней изменения
+    auto parsed = ParseFormula("#REF!+1");
+    ASSERT_EQUAL(parsed->GetExpression(), "#REF!+1");
+    ASSERT(parsed->GetReferencedCells().empty());
+    ASSERT_EQUAL(std::get<FormulaError>(parsed->Evaluate(sheet)),
+                 FormulaError(FormulaError::Category::Ref));
+    Sheet base;
+    sheet.ForEachCell([&base](Position pos, const Cell& cell) {
+        base.SetCell(pos, cell.GetText());
+    });
+    ASSERT(base.Diff(sheet).empty());
+    Sheet ours;
+    Sheet theirs;
+    for (Sheet* copy : {&ours, &theirs}) {
+        copy->SetCell("A1"_pos, "1");
+        copy->SetCell("A2"_pos, "=A1+B1");
+    }
+    base.SetCells({{"A1"_pos, "1"}, {"A2"_pos, "=A1+B1"}});
+    theirs.DeleteCols(1);
+    MergeResult merged = ours.Merge(base, theirs);
+    ASSERT(merged.conflicts.empty());
+    ASSERT_EQUAL(text(ours, "A2"_pos), "=A1+#REF!");
+
+    // Недопустимые аргументы и вытеснение непустых ячеек за пределы таблицы
+    // не изменяют таблицу
+    const std::uint64_t epoch = sheet.GetEpoch();
+    for (auto [first, count] : {std::pair{-1, 1}, {0, 0}, {Position::MAX_ROWS - 1, 2}}) {
+        bool caught = false;
+        try {
+            sheet.DeleteRows(first, count);
+        } catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+    Sheet edge;
+    edge.SetCell({Position::MAX_ROWS - 1, 0}, "x");
+    bool caught = false;
+    try {
+        edge.InsertRows(0);
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(edge.GetCell({Position::MAX_ROWS - 1, 0})->GetText(), "x");
+    ASSERT_EQUAL(sheet.GetEpoch(), epoch);
+
+    // Пустая ячейка, вытесненная за пределы таблицы, даёт #REF!
+    edge.SetCell("A1"_pos, "=A1048576");
+    edge.ClearCell({Position::MAX_ROWS - 1, 0});
+    edge.InsertRows(0);
+    ASSERT_EQUAL(edge.GetCell("A2"_pos)->GetText(), "=#REF!");
+
+    // Реплика повторяет вставку и удаление
+    log.Flush();
+    ASSERT(reader.ApplyBatch());
+    ASSERT(replica.Diff(sheet).empty());
+    ASSERT_EQUAL(value(replica, "B2"_pos), ref_error);
+
+    // Те же действия в режимах Eager и Epoch
+    for (RecalculationMode mode : {RecalculationMode::Eager, RecalculationMode::Epoch}) {
+        Sheet other;
+        other.SetRecalculationMode(mode);
+        other.SetCell("A1"_pos, "1");
+        other.SetCell("A2"_pos, "2");
+        other.SetCell("B1"_pos, "=A1+A2");
+        other.SetCell("C1"_pos, "=B1*2");
+        ASSERT_EQUAL(value(other, "C1"_pos), CellInterface::Value(6.0));
+        other.InsertRows(0);
+        ASSERT_EQUAL(value(other, "C2"_pos), CellInterface::Value(6.0));
+        other.SetCell("A3"_pos, "5");
+        ASSERT_EQUAL(value(other, "C2"_pos), CellInterface::Value(12.0));
+        other.DeleteRows(2);
+        ASSERT_EQUAL(value(other, "C2"_pos), ref_error);
+        other.EvaluateAll();
+    }
+
+    // В режиме Epoch формула, все ссылки которой стали #REF!, не вычисляется
+    // при чтении зависимых, поэтому её значение отмечается изменённым
+    Sheet epoch_sheet;
+    epoch_sheet.SetRecalculationMode(RecalculationMode::Epoch);
+    epoch_sheet.SetCell("C5"_pos, "5");
+    epoch_sheet.SetCell("A1"_pos, "=C5");
+    epoch_sheet.SetCell("A2"_pos, "=A1+1");
+    ASSERT_EQUAL(value(epoch_sheet, "A2"_pos), CellInterface::Value(6.0));
+    epoch_sheet.DeleteRows(4);
+    ASSERT_EQUAL(epoch_sheet.GetCell("A1"_pos)->GetText(), "=#REF!");
+    ASSERT_EQUAL(value(epoch_sheet, "A2"_pos), ref_error);
+}
+
+void TestCopyRange() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    auto text = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetText();
+    };
+
+    Sheet sheet;
+    sheet.SetUndoLimit(4);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "'=2");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("B2"_pos, "=A1+B1");
+
+    // Ссылки сдвигаются на смещение областей
+    sheet.CopyRange({"A1"_pos, {2, 2}}, "C3"_pos);
+    ASSERT_EQUAL(text(sheet, "C3"_pos), "1");
+    ASSERT_EQUAL(text(sheet, "C4"_pos), "'=2");
+    ASSERT_EQUAL(text(sheet, "D3"_pos), "=C3*2");
+    ASSERT_EQUAL(text(sheet, "D4"_pos), "=C3+D3");
+    ASSERT_EQUAL(value(sheet, "D4"_pos), CellInterface::Value(3.0));
+    sheet.SetCell("C3"_pos, "5");
+    ASSERT_EQUAL(value(sheet, "D4"_pos), CellInterface::Value(15.0));
+    ASSERT_EQUAL(value(sheet, "B2"_pos), CellInterface::Value(3.0));
+
+    // Ссылки за пределы таблицы становятся #REF!, пустые ячейки источника
+    // очищают назначение
+    sheet.SetCell("A5"_pos, "x");
+    sheet.CopyRange({"B1"_pos, {2, 1}}, "A4"_pos);
+    ASSERT_EQUAL(text(sheet, "A4"_pos), "=#REF!*2");
+    ASSERT_EQUAL(value(sheet, "A4"_pos),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(text(sheet, "A5"_pos), "=#REF!+A4");
+    sheet.CopyRange({"F1"_pos, {2, 1}}, "A4"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos), nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos), nullptr);
+
+    // Копирование целиком отменяется одним изменением
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(text(sheet, "A5"_pos), "=#REF!+A4");
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(text(sheet, "A5"_pos), "x");
+
+    // Перекрывающиеся области: источник читается до изменения
+    sheet.SetCell("A10"_pos, "1");
+    sheet.SetCell("A11"_pos, "=A10+1");
+    sheet.CopyRange({"A10"_pos, {2, 1}}, "A11"_pos);
+    ASSERT_EQUAL(text(sheet, "A11"_pos), "1");
+    ASSERT_EQUAL(text(sheet, "A12"_pos), "=A11+1");
+    ASSERT_EQUAL(value(sheet, "A12"_pos), CellInterface::Value(2.0));
+
+    // Циклическая зависимость и выход за пределы таблицы не изменяют таблицу
+    sheet.SetCell("E1"_pos, "=D1");
+    sheet.SetCell("C1"_pos, "=D1");
+    bool caught = false;
+    try {
+        sheet.CopyRange({"C1"_pos, {1, 1}}, "D1"_pos);
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(text(sheet, "D1"_pos), "");
+    caught = false;
+    try {
+        sheet.CopyRange({"A1"_pos, {2, 2}}, {Position::MAX_ROWS - 1, 0});
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell({Position::MAX_ROWS - 1, 0}), nullptr);
+}
+
 void TestClearCell() {
     auto sheet = CreateSheet();
 
@@ -132,6 +1061,405 @@ void TestClearCell() {
     sheet->ClearCell("J10"_pos);
 }
 
+void TestClearCellInvalidatesDependents() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    // На A1 ссылается формула, поэтому остаётся пустая ячейка
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("A1"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // После очистки B1 её зависимость от A1 не должна приводить к циклу
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet.SetCell("A1"_pos, "=C1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestClearRange() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "2");
+    sheet.SetCell("A2"_pos, "=A1+B1");
+    sheet.SetCell("B2"_pos, "=A2*10");
+    sheet.SetCell("D1"_pos, "=B2+A1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(31.0));
+
+    sheet.ClearRange({"A1"_pos, {2, 2}});
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 4}));
+
+    sheet.ClearRange({"C1"_pos, {1, 2}});
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+
+    try {
+        sheet.ClearRange({"A1"_pos, {Position::MAX_ROWS + 1, 1}});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestPlaceholderReclaim() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=C3+D4");
+    ASSERT(sheet.GetCell("C3"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+
+    // D4 больше не нужна ни одной формуле, C3 всё ещё используется
+    sheet.SetCell("A1"_pos, "=C3");
+    ASSERT(sheet.GetCell("C3"_pos) != nullptr);
+    ASSERT(sheet.GetCell("D4"_pos) == nullptr);
+
+    sheet.SetCell("B1"_pos, "=C3");
+    sheet.SetCell("A1"_pos, "text");
+    ASSERT(sheet.GetCell("C3"_pos) != nullptr);
+    sheet.ClearCell("B1"_pos);
+    ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+
+    // Пустые ячейки, заданные явно, удаляются при уплотнении
+    sheet.SetCell("E5"_pos, "");
+    sheet.SetCell("F6"_pos, "=E5");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{6, 6}));
+    sheet.SetCell("F6"_pos, "");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    sheet.Compact();
+    ASSERT(sheet.GetCell("E5"_pos) == nullptr);
+    ASSERT(sheet.GetCell("F6"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "text");
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "text\n");
+}
+
+void TestLargeSheet() {
+    Sheet sheet;
+    sheet.SetCell("A1048576"_pos, "1");
+    sheet.SetCell("XFD1048575"_pos, "=A1048576*2");
+    sheet.SetCell("B1"_pos, "=XFD1048575+A1048576");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=XFD1048575+A1048576");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+
+    sheet.ClearRange({"A1048576"_pos, {1, Position::MAX_COLS}});
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{Position::MAX_ROWS - 1, Position::MAX_COLS}));
+
+    sheet.ClearCell("XFD1048575"_pos);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+}
+
+void TestForEachCell() {
+    Sheet sheet;
+    sheet.SetCell("C3"_pos, "c3");
+    sheet.SetCell("BZ1"_pos, "bz1");
+    sheet.SetCell("A1"_pos, "=C3");
+    sheet.SetCell("B3"_pos, "=D7");
+    sheet.SetCell("A1000"_pos, "a1000");
+
+    std::vector<Position> visited;
+    sheet.ForEachCell([&visited](Position pos, const Cell&) {
+        visited.push_back(pos);
+    });
+    ASSERT_EQUAL(visited, (std::vector{"A1"_pos, "BZ1"_pos, "B3"_pos, "C3"_pos, "A1000"_pos}));
+
+    visited.clear();
+    sheet.ForEachCellInRange({"B1"_pos, {3, 76}}, [&visited](Position pos, const Cell&) {
+        visited.push_back(pos);
+    });
+    ASSERT_EQUAL(visited, (std::vector{"B3"_pos, "C3"_pos}));
+
+    sheet.ClearCell("A1000"_pos);
+    sheet.ClearCell("BZ1"_pos);
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=C3\t\t\n\t\t\n\t=D7\tc3\n");
+}
+
+void TestDeepChain() {
+    constexpr int chain_length = 100000;
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "1");
+    for (int r = 1; r < chain_length; ++r) {
+        sheet.SetCell({r, 0}, "=" + Position{r - 1, 0}.ToString() + "+1");
+    }
+    const CellInterface* tail = sheet.GetCell({chain_length - 1, 0});
+    ASSERT_EQUAL(tail->GetValue(), CellInterface::Value(double(chain_length)));
+
+    // Сброс кэша и проверка циклов тоже проходят всю цепочку
+    sheet.SetCell({0, 0}, "2");
+    ASSERT_EQUAL(tail->GetValue(), CellInterface::Value(double(chain_length + 1)));
+
+    bool caught = false;
+    try {
+        sheet.SetCell({0, 0}, "=" + Position{chain_length - 1, 0}.ToString());
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestEagerRecalculation() {
+    Sheet sheet;
+    sheet.SetRecalculationMode(RecalculationMode::Eager);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*0+5");
+    sheet.SetCell("C1"_pos, "=B1+A1");
+    sheet.SetCell("D1"_pos, "=C1*2");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(16.0));
+
+    // То же значение, введённое заново, и формула с тем же результатом
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("B1"_pos, "=2+3");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(16.0));
+
+    sheet.SetCell("B1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    sheet.ClearRange({"A1"_pos, {1, 2}});
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    sheet.SetRecalculationMode(RecalculationMode::Lazy);
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(14.0));
+
+    // Замена -0 на 0 не отсекает пересчёт зависимых
+    sheet.SetRecalculationMode(RecalculationMode::Eager);
+    sheet.SetCell("F1"_pos, "-5");
+    sheet.SetCell("G1"_pos, "=F1*0");
+    sheet.SetCell("H1"_pos, "=G1");
+    ASSERT(std::signbit(std::get<double>(sheet.GetCell("H1"_pos)->GetValue())));
+    sheet.SetCell("F1"_pos, "5");
+    ASSERT(!std::signbit(std::get<double>(sheet.GetCell("H1"_pos)->GetValue())));
+}
+
+void TestEpochRecalculation() {
+    Sheet sheet;
+    sheet.SetRecalculationMode(RecalculationMode::Epoch);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*0+5");
+    sheet.SetCell("C1"_pos, "=B1+A1");
+    sheet.SetCell("D1"_pos, "=C1*2");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(16.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    // Несколько правок между чтениями
+    sheet.SetCell("A1"_pos, "4");
+    sheet.SetCell("E1"_pos, "text");
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    sheet.SetCell("B1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    sheet.ClearRange({"A1"_pos, {1, 2}});
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    sheet.SetRecalculationMode(RecalculationMode::Lazy);
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(14.0));
+
+    sheet.SetRecalculationMode(RecalculationMode::Epoch);
+    sheet.SetCell("A1"_pos, "8");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(16.0));
+
+    // Замена -0 на 0 - изменение значения
+    sheet.SetCell("F1"_pos, "-5");
+    sheet.SetCell("G1"_pos, "=F1*0");
+    ASSERT(std::signbit(std::get<double>(sheet.GetCell("G1"_pos)->GetValue())));
+    sheet.SetCell("F1"_pos, "5");
+    ASSERT(!std::signbit(std::get<double>(sheet.GetCell("G1"_pos)->GetValue())));
+}
+
+void TestColumnKernel() {
+    Sheet sheet;
+    const int rows = 300;
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, std::to_string(row % 7));
+        sheet.SetCell({row, 2}, std::to_string(row * 0.5));
+        sheet.SetCell({row, 3}, "=A" + r + "*B" + r + "+C" + r);
+        sheet.SetCell({row, 4}, "=A" + r + "/B" + r);
+        sheet.SetCell({row, 5}, "=-D" + r + "-E" + r);
+        sheet.SetCell({row, 6}, row == 0 ? "1" : "=G" + std::to_string(row) + "+1");
+    }
+    // Текст, пустая ячейка, ошибки аргументов и формула другого вида в блоке
+    sheet.SetCell("B51"_pos, "x");
+    sheet.SetCell("B52"_pos, "'3");
+    sheet.ClearCell("C61"_pos);
+    sheet.SetCell("B71"_pos, "=1/0");
+    sheet.SetCell("A71"_pos, "=B52+1");
+    sheet.SetCell("C81"_pos, "=B51");
+    sheet.SetCell("D91"_pos, "=A91+B91");
+
+    sheet.EvaluateAll();
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 3; col < 7; ++col) {
+            const Cell* cell = sheet.GetConcreteCell({row, col});
+            const std::string text = cell->GetText();
+            if (text.front() != '=') {
+                continue;
+            }
+            FormulaInterface::Value expected = ParseFormula(text.substr(1))->Evaluate(sheet);
+            if (std::holds_alternative<double>(expected)) {
+                ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(std::get<double>(expected)));
+            } else {
+                ASSERT_EQUAL(cell->GetValue(),
+                             CellInterface::Value(std::get<FormulaError>(expected)));
+            }
+        }
+    }
+    ASSERT_EQUAL(sheet.GetCell("D71"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(sheet.GetCell("E51"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("G300"_pos)->GetValue(), CellInterface::Value(300.0));
+
+    // Блок пересчитывается после изменения аргументов
+    sheet.SetCell("A2"_pos, "10");
+    sheet.EvaluateAll();
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(10.5));
+    ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetValue(), CellInterface::Value(-20.5));
+}
+
+void TestEvaluateAllFallback() {
+    // После EvaluateAll ни одна формула не требует вычисления, в том числе
+    // формулы вне векторных блоков: короткие блоки, ссылки на свой столбец
+    for (RecalculationMode mode :
+         {RecalculationMode::Lazy, RecalculationMode::Eager, RecalculationMode::Epoch}) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        for (int row = 0; row < 40; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell({row, 0}, std::to_string(row));
+            sheet.SetCell({row, 1}, "=A" + r + "*2");
+            sheet.SetCell({row, 2}, row == 0 ? "=A1" : "=C" + std::to_string(row) + "+A" + r);
+        }
+        sheet.SetCell("D1"_pos, "=A1+B1");
+        sheet.SetCell("D2"_pos, "=B2-A2");
+        sheet.SetCell("D3"_pos, "=1+2");
+        sheet.SetCell("A1"_pos, "5");
+
+        sheet.EvaluateAll();
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                const Cell* cell = sheet.GetConcreteCell({row, col});
+                ASSERT(cell == nullptr || !cell->NeedsEvaluation());
+            }
+        }
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(15.0));
+        ASSERT_EQUAL(sheet.GetCell("C40"_pos)->GetValue(), CellInterface::Value(785.0));
+    }
+}
+
+void TestShadowColumns() {
+    // Теневые столбцы должны совпадать со значениями ячеек
+    auto check = [](const Sheet& sheet) {
+        const Size size = sheet.GetPrintableSize();
+        std::vector<double> values(size.rows + 1);
+        std::vector<ShadowStatus> statuses(size.rows + 1);
+        for (int col = 0; col < size.cols + 1; ++col) {
+            sheet.ReadColumn({0, col}, values.size(), values.data(), statuses.data());
+            for (int row = 0; row < size.rows + 1; ++row) {
+                const Cell* cell = sheet.GetConcreteCell({row, col});
+                std::pair<ShadowStatus, double> expected{ShadowStatus::Empty, 0.0};
+                if (cell && !cell->IsEmpty()) {
+                    expected = ShadowColumns::Classify(cell->GetValueView(),
+                                                       cell->GetProgram() == nullptr);
+                }
+                ASSERT(statuses[row] == expected.first);
+                ASSERT_EQUAL(values[row], expected.second);
+            }
+        }
+    };
+
+    for (RecalculationMode mode :
+         {RecalculationMode::Lazy, RecalculationMode::Eager, RecalculationMode::Epoch}) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("A2"_pos, "text");
+        sheet.SetCell("A3"_pos, "'5");
+        sheet.SetCell("B1"_pos, "=A1*10");
+        sheet.SetCell("B2"_pos, "=A2+1");
+        sheet.SetCell("B3"_pos, "=A3/0");
+        sheet.SetCell("C1"_pos, "=B1+A3");
+        check(sheet);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(25.0));
+        check(sheet);
+
+        sheet.SetCell("A1"_pos, "4");
+        check(sheet);
+        sheet.EvaluateAll();
+        check(sheet);
+        sheet.ClearCell("A3"_pos);
+        sheet.ClearRange({"A2"_pos, {1, 2}});
+        check(sheet);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(40.0));
+        sheet.SetCell("A300"_pos, "1.5");
+        sheet.SetCell("A1"_pos, "=A300*2");
+        check(sheet);
+
+        double value = 0;
+        ShadowStatus status = ShadowStatus::Stale;
+        sheet.ReadColumn("C1"_pos, 1, &value, &status);
+        ASSERT(status == ShadowStatus::Number);
+        ASSERT_EQUAL(value, 30.0);
+    }
+
+    Sheet sheet;
+    double value = 0;
+    ShadowStatus status;
+    try {
+        sheet.ReadColumn({Position::MAX_ROWS - 1, 0}, 2, &value, &status);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestCircularReferenceRollback() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1");
+    try {
+        sheet.SetCell("B1"_pos, "=A1+C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+
+    // Отменённые зависимости B1 не должны участвовать в проверке циклов
+    sheet.SetCell("C1"_pos, "=B1");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
 void TestFormulaArithmetic() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -190,6 +1518,11 @@ void TestFormulaReferencedCells() {
     auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
     ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+
+    PositionSpan view = tricky->GetReferencedCellsView();
+    ASSERT_EQUAL(std::vector<Position>(view.begin(), view.end()),
+                 (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+    ASSERT(tricky->GetReferencedCellsView().begin() == view.begin());
 }
 
 void TestErrorValue() {
@@ -265,9 +1598,9 @@ void TestFormulaInvalidPosition() {
 
     try_formula("=X0");
     try_formula("=ABCD1");
-    try_formula("=A123456");
+    try_formula("=A1234567");
     try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-    try_formula("=XFD16385");
+    try_formula("=XFD1048577");
     try_formula("=XFE16384");
     try_formula("=R2D2");
 }
@@ -357,17 +1690,409 @@ void TestCellCircularReferences() {
 
     ASSERT(caught);
 }
+
+// Время выполнения func в миллисекундах
+template <typename Func>
+double MeasureMs(Func func) {
+    const auto start = std::chrono::steady_clock::now();
+    func();
+    const auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(finish - start).count();
+}
+
+// Сравнение стратегий инвалидации. Ячейка A1 имеет fan_out зависимых, в
+// столбце C цепочка глубины CHAIN_DEPTH. На каждом шаге меняется A1 и
+// читается конец цепочки. Режим Lazy обходит все зависимые A1 при изменении,
+// режим Epoch проверяет цепочку при чтении: с ростом fan_out выгоднее Epoch
+void RunInvalidationBenchmark() {
+    const int CHAIN_DEPTH = 1000;
+    const int ITERATIONS = 200;
+
+    auto run = [&](RecalculationMode mode, int fan_out) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        sheet.SetCell({0, 0}, "0");
+        for (int i = 0; i < fan_out; ++i) {
+            sheet.SetCell({i, 1}, "=A1+1");
+        }
+        sheet.SetCell({0, 2}, "1");
+        for (int i = 1; i < CHAIN_DEPTH; ++i) {
+            sheet.SetCell({i, 2}, "=" + Position{i - 1, 2}.ToString() + "+1");
+        }
+        for (int i = 0; i < fan_out; ++i) {
+            sheet.GetCell({i, 1})->GetValue();
+        }
+
+        return MeasureMs([&] {
+            for (int i = 0; i < ITERATIONS; ++i) {
+                sheet.SetCell({0, 0}, std::to_string(i));
+                sheet.GetCell({CHAIN_DEPTH - 1, 2})->GetValue();
+            }
+        });
+    };
+
+    std::cout << "fan_out\tlazy, ms\tepoch, ms" << std::endl;
+    for (int fan_out : {10, 100, 1000, 10000}) {
+        std::cout << fan_out << '\t' << run(RecalculationMode::Lazy, fan_out) << '\t'
+                  << run(RecalculationMode::Epoch, fan_out) << std::endl;
+    }
+}
+
+// Вычисление протянутой вниз формулы =A{i}*B{i}+C{i} по одной ячейке и
+// блоком через ColumnKernel
+void RunColumnKernelBenchmark() {
+    const int rows = 500000;
+    auto fill = [&](Sheet& sheet) {
+        for (int row = 0; row < rows; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell({row, 0}, std::to_string(row));
+            sheet.SetCell({row, 1}, "2");
+            sheet.SetCell({row, 2}, "1");
+            sheet.SetCell({row, 3}, "=A" + r + "*B" + r + "+C" + r);
+        }
+    };
+    // Аргументы вычислены заранее: измеряется только вычисление формул
+    auto warm_up = [&](const Sheet& sheet) {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < 3; ++col) {
+                sheet.GetConcreteCell({row, col})->GetValueView();
+            }
+        }
+    };
+
+    Sheet scalar;
+    fill(scalar);
+    warm_up(scalar);
+    const double scalar_ms = MeasureMs([&] {
+        for (int row = 0; row < rows; ++row) {
+            scalar.GetCell({row, 3})->GetValue();
+        }
+    });
+    Sheet vectorized;
+    fill(vectorized);
+    warm_up(vectorized);
+    const double kernel_ms = MeasureMs([&] {
+        vectorized.EvaluateAll();
+    });
+    std::cout << rows << " fill-down formulas: per cell " << scalar_ms << " ms, column kernel "
+              << kernel_ms << " ms" << std::endl;
+}
+
+void RunPrintValuesBenchmark() {
+    const int rows = 200000;
+    Sheet sheet;
+    std::vector<double> numbers;
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "/7");
+    }
+    sheet.ForEachCellInRange({{0, 1}, {rows, 1}}, [&numbers](Position, const Cell& cell) {
+        numbers.push_back(std::get<double>(cell.GetValueView()));
+    });
+
+    // Только вывод чисел: operator<< против to_chars в обоих режимах
+    const double stream_ms = MeasureMs([&] {
+        std::ostringstream output;
+        for (double number : numbers) {
+            output << number << '\t';
+        }
+    });
+    double format_ms[2];
+    for (NumberFormat format : {NumberFormat::Shortest, NumberFormat::Stream}) {
+        format_ms[static_cast<int>(format)] = MeasureMs([&] {
+            std::ostringstream output;
+            for (double number : numbers) {
+                WriteNumber(output, number, format);
+                output << '\t';
+            }
+        });
+    }
+    std::cout << numbers.size() << " numbers: operator<< " << stream_ms << " ms, shortest "
+              << format_ms[0] << " ms, stream-compatible " << format_ms[1] << " ms" << std::endl;
+}
+
+void RunParallelExportBenchmark() {
+    const int rows = 200000;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "=A" + r + "/7");
+        sheet.SetCell({row, 2}, "=B" + r + "*A" + r);
+        sheet.SetCell({row, 3}, "text " + r);
+    }
+    sheet.EvaluateAll();
+
+    std::cout << rows << "x4 cells, PrintValues:";
+    std::cout << " serial " << MeasureMs([&] {
+        std::ostringstream output;
+        sheet.PrintValues(output);
+    }) << " ms";
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        std::cout << ", " << threads << " threads " << MeasureMs([&] {
+            std::ostringstream output;
+            sheet.PrintValuesParallel(output, threads);
+        }) << " ms";
+    }
+    std::cout << std::endl;
+}
+
+void RunFrozenSheetBenchmark() {
+    const int rows = 200000;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "=A" + r + "/7");
+        sheet.SetCell({row, 2}, row % 2 ? "USD" : "EUR");
+    }
+    sheet.EvaluateAll();
+    const FrozenSheet frozen = sheet.Freeze();
+
+    // Чтение в порядке, не совпадающем с порядком хранения
+    double sum = 0;
+    const double sheet_ms = MeasureMs([&] {
+        for (int i = 0; i < rows; ++i) {
+            sum += std::get<double>(sheet.GetCell({(i * 7919) % rows, 1})->GetValueView());
+        }
+    });
+    const double frozen_ms = MeasureMs([&] {
+        for (int i = 0; i < rows; ++i) {
+            sum += std::get<double>(frozen.GetValue({(i * 7919) % rows, 1}));
+        }
+    });
+    std::cout << rows << " random reads: sheet " << sheet_ms << " ms, frozen " << frozen_ms
+              << " ms; frozen sheet of " << frozen.GetCellCount() << " cells uses "
+              << frozen.GetMemoryUsage() / 1024 << " KiB (checksum " << sum << ")" << std::endl;
+}
+
+void RunArrowExportBenchmark() {
+    const int rows = 500000;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "=A" + r + "/7");
+    }
+    sheet.EvaluateAll();
+
+    const double print_ms = MeasureMs([&] {
+        std::ostringstream output;
+        sheet.PrintValues(output);
+    });
+    ArrowSchema schema;
+    ArrowArray array;
+    const double arrow_ms = MeasureMs([&] {
+        ExportArrow(sheet, &schema, &array);
+    });
+    array.release(&array);
+    schema.release(&schema);
+    std::cout << rows << "x2 cells: PrintValues " << print_ms << " ms, Arrow export " << arrow_ms
+              << " ms" << std::endl;
+}
+
+void RunSheetDiffBenchmark() {
+    const int rows = 1000000;
+    Sheet lhs;
+    Sheet rhs;
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        for (Sheet* sheet : {&lhs, &rhs}) {
+            sheet->SetCell({row, 0}, std::to_string(row));
+            sheet->SetCell({row, 1}, "=A" + r + "/7");
+        }
+    }
+
+    // Первое сравнение вычисляет хеши всех блоков, следующие пересчитывают
+    // хеши только изменённых блоков
+    const double first_ms = MeasureMs([&] {
+        lhs.Diff(rhs);
+    });
+    for (int i = 0; i < 5; ++i) {
+        rhs.SetCell({i * 100000, 0}, "changed");
+    }
+    std::size_t changes = 0;
+    const double diff_ms = MeasureMs([&] {
+        changes = lhs.Diff(rhs).size();
+    });
+    std::cout << rows << "x2 cells: first Diff " << first_ms << " ms, Diff of " << changes
+              << " changes " << diff_ms << " ms" << std::endl;
+}
+
+void RunReplicationBenchmark() {
+    const int rows = 200000;
+
+    std::stringstream channel;
+    Sheet leader;
+    ReplicationLog log(channel);
+    leader.SetReplicationLog(&log);
+    const double leader_ms = MeasureMs([&] {
+        for (int row = 0; row < rows; ++row) {
+            const std::string r = std::to_string(row + 1);
+            leader.SetCell({row, 0}, std::to_string(row));
+            leader.SetCell({row, 1}, "=(A" + r + "+1)*A" + r + "/7");
+        }
+        log.Flush();
+    });
+
+    Sheet replica;
+    ReplicaReader reader(replica, channel);
+    const double replica_ms = MeasureMs([&] {
+        reader.ApplyBatch();
+    });
+    std::cout << rows << "x2 cells: SetCell " << leader_ms << " ms, replica batch " << replica_ms
+              << " ms" << std::endl;
+}
+
+void RunUndoBenchmark() {
+    const int rows = 200000;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+    }
+    sheet.SetUndoLimit(16);
+
+    // Вставка блока 1000x10 формул поверх чисел и пустых ячеек
+    std::vector<std::pair<Position, std::string>> paste;
+    for (int row = 0; row < 1000; ++row) {
+        for (int col = 0; col < 10; ++col) {
+            paste.emplace_back(Position{row, col}, "=A" + std::to_string(row + 1001) + "*2");
+        }
+    }
+    const double paste_ms = MeasureMs([&] {
+        sheet.SetCells(std::move(paste));
+    });
+    const double undo_ms = MeasureMs([&] {
+        sheet.Undo();
+    });
+    const double redo_ms = MeasureMs([&] {
+        sheet.Redo();
+    });
+    std::cout << "10k-cell paste: SetCells " << paste_ms << " ms, Undo " << undo_ms
+              << " ms, Redo " << redo_ms << " ms" << std::endl;
+}
+
+void RunInsertRowsBenchmark() {
+    const int rows = 200000;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row) {
+        const std::string name = std::to_string(row + 1);
+        cells.emplace_back(Position{row, 0}, name);
+        cells.emplace_back(Position{row, 1}, "=A" + name + "*2");
+        cells.emplace_back(Position{row, 2}, "=B" + name + "+A1");
+    }
+    sheet.SetCells(std::move(cells));
+    sheet.EvaluateAll();
+
+    // Стоимость пропорциональна числу сдвигаемых ячеек и ссылающихся на них
+    // формул, а не размеру таблицы
+    const double near_end_ms = MeasureMs([&] {
+        sheet.InsertRows(rows - 1000);
+    });
+    const double near_start_ms = MeasureMs([&] {
+        sheet.InsertRows(1000);
+    });
+    const double delete_ms = MeasureMs([&] {
+        sheet.DeleteRows(1000, 2);
+    });
+    std::cout << "200k-row sheet: insert row 1000 rows from the end " << near_end_ms
+              << " ms, 1000 rows from the start " << near_start_ms << " ms, delete "
+              << delete_ms << " ms" << std::endl;
+}
+
+void RunCopyRangeBenchmark() {
+    const int rows = 1000;
+    const int cols = 50;
+    // Текст ячейки блока, сдвинутого на offset строк
+    auto block_text = [](int row, int col, int offset) {
+        if (col == 0) {
+            return std::to_string(row);
+        }
+        const Position left{row + offset, col - 1};
+        if (row == 0) {
+            return "=" + left.ToString() + "+1";
+        }
+        const Position up{row - 1 + offset, col};
+        return "=" + left.ToString() + "+" + up.ToString() + "*2";
+    };
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            cells.emplace_back(Position{row, col}, block_text(row, col, 0));
+        }
+    }
+    sheet.SetCells(std::move(cells));
+
+    // Копирование через текст: каждая формула разбирается и проверяется на
+    // циклы отдельно
+    const double text_ms = MeasureMs([&] {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                sheet.SetCell({row + rows, col}, block_text(row, col, rows));
+            }
+        }
+    });
+    const double copy_ms = MeasureMs([&] {
+        sheet.CopyRange({{0, 0}, {rows, cols}}, {2 * rows, 0});
+    });
+    std::cout << "1000x50 formula block copy: SetCell per cell " << text_ms
+              << " ms, CopyRange " << copy_ms << " ms" << std::endl;
+}
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string_view(argv[1]) == "--benchmark") {
+        RunInvalidationBenchmark();
+        RunColumnKernelBenchmark();
+        RunPrintValuesBenchmark();
+        RunParallelExportBenchmark();
+        RunFrozenSheetBenchmark();
+        RunArrowExportBenchmark();
+        RunSheetDiffBenchmark();
+        RunReplicationBenchmark();
+        RunUndoBenchmark();
+        RunInsertRowsBenchmark();
+        RunCopyRangeBenchmark();
+        return 0;
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionKey);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestCellValue);
+    RUN_TEST(tr, TestStringPool);
+    RUN_TEST(tr, TestCellStorageValueSlots);
+    RUN_TEST(tr, TestNumberFormat);
+    RUN_TEST(tr, TestParallelExport);
+    RUN_TEST(tr, TestFrozenSheet);
+    RUN_TEST(tr, TestGetValues);
+    RUN_TEST(tr, TestArrowExport);
+    RUN_TEST(tr, TestSheetDiffMerge);
+    RUN_TEST(tr, TestReplication);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestInsertDeleteLines);
+    RUN_TEST(tr, TestCopyRange);
     RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestClearCellInvalidatesDependents);
+    RUN_TEST(tr, TestClearRange);
+    RUN_TEST(tr, TestPlaceholderReclaim);
+    RUN_TEST(tr, TestLargeSheet);
+    RUN_TEST(tr, TestForEachCell);
+    RUN_TEST(tr, TestDeepChain);
+    RUN_TEST(tr, TestEagerRecalculation);
+    RUN_TEST(tr, TestEpochRecalculation);
+    RUN_TEST(tr, TestColumnKernel);
+    RUN_TEST(tr, TestEvaluateAllFallback);
+    RUN_TEST(tr, TestShadowColumns);
+    RUN_TEST(tr, TestCircularReferenceRollback);
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
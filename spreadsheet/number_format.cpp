@@ -0,0 +1,53 @@
+#include "number_format.h"
+
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <locale>
+
+namespace {
+
+// Флаги, при которых запись числа в потоке отличается от printf("%g")
+const std::ios_base::fmtflags NON_GENERAL_FLAGS = std::ios_base::floatfield
+    | std::ios_base::showpoint | std::ios_base::showpos | std::ios_base::uppercase;
+
+// Запись числа при точности до 17 значащих цифр в формате %g не длиннее
+// 24 символов; большую точность обрабатывает operator<<
+const std::streamsize MAX_STREAM_PRECISION = 17;
+
+}  // namespace
+
+char* FormatNumber(double value, char* first, char* last) {
+    std::to_chars_result result = std::to_chars(first, last, value);
+    assert(result.ec == std::errc());
+    return result.ptr;
+}
+
+std::string FormatNumber(double value) {
+    std::array<char, MAX_NUMBER_LENGTH> buffer;
+    return {buffer.data(), FormatNumber(value, buffer.data(), buffer.data() + buffer.size())};
+}
+
+void WriteNumber(std::ostream& output, double value, NumberFormat format) {
+    std::array<char, MAX_NUMBER_LENGTH> buffer;
+    char* end;
+    if (format == NumberFormat::Shortest) {
+        end = FormatNumber(value, buffer.data(), buffer.data() + buffer.size());
+    } else {
+        // operator<<(double) без флагов формата выводит число как printf("%g")
+        // с точностью потока в локали "C", и так же работает std::to_chars
+        // с chars_format::general
+        if ((output.flags() & NON_GENERAL_FLAGS) != 0 || output.width() != 0
+            || output.precision() > MAX_STREAM_PRECISION
+            || output.getloc() != std::locale::classic()) {
+            output << value;
+            return;
+        }
+        std::to_chars_result result
+            = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value,
+                            std::chars_format::general, static_cast<int>(output.precision()));
+        assert(result.ec == std::errc());
+        end = result.ptr;
+    }
+    output.write(buffer.data(), end - buffer.data());
+}
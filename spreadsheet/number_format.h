@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+// Способ вывода чисел в значениях ячеек
+enum class NumberFormat {
+    // Кратчайшая запись, из которой читается то же самое число
+    // (std::to_chars без точности)
+    Shortest,
+    // Совместимость: та же запись, что даёт operator<<(double) для потока
+    // вывода с его точностью и флагами
+    Stream,
+};
+
+// Наибольшая длина записи числа в режиме Shortest (например,
+// "-2.2250738585072014e-308")
+constexpr std::size_t MAX_NUMBER_LENGTH = 32;
+
+// Записывает число в буфер [first, last) без учёта локали и возвращает
+// конец записи. Буфера длиной MAX_NUMBER_LENGTH достаточно для Shortest
+char* FormatNumber(double value, char* first, char* last);
+
+std::string FormatNumber(double value);
+
+// Выводит число в поток в заданном формате. В режиме Stream поток с
+// нестандартными флагами или локалью получает число через operator<<
+void WriteNumber(std::ostream& output, double value, NumberFormat format);
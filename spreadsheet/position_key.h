@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Позиция ячейки, упакованная в ключ в порядке Z-кривой (код Мортона):
+// биты строки и столбца чередуются, поэтому соседние и по строке, и по
+// столбцу ячейки получают близкие ключи. Строка занимает 20 бит, столбец -
+// 14, поэтому ключ не помещается в 32 бита и хранится в 64-битном целом.
+using PositionKey = std::uint64_t;
+
+namespace position_key_detail {
+
+// Разносит младшие 32 бита по чётным разрядам
+inline std::uint64_t SpreadBits(std::uint64_t x) {
+    x &= 0x00000000FFFFFFFFull;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2)) & 0x3333333333333333ull;
+    x = (x | (x << 1)) & 0x5555555555555555ull;
+    return x;
+}
+
+// Собирает чётные разряды обратно в младшие 32 бита
+inline std::uint64_t CompactBits(std::uint64_t x) {
+    x &= 0x5555555555555555ull;
+    x = (x | (x >> 1)) & 0x3333333333333333ull;
+    x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x >> 4)) & 0x00FF00FF00FF00FFull;
+    x = (x | (x >> 8)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+    return x;
+}
+
+}  // namespace position_key_detail
+
+inline PositionKey ToKey(Position pos) {
+    using namespace position_key_detail;
+    return SpreadBits(static_cast<std::uint32_t>(pos.col))
+        | (SpreadBits(static_cast<std::uint32_t>(pos.row)) << 1);
+}
+
+inline Position FromKey(PositionKey key) {
+    using namespace position_key_detail;
+    return {static_cast<int>(CompactBits(key >> 1)), static_cast<int>(CompactBits(key))};
+}
+
+struct PositionKeyHasher {
+    // Перемешивание битов (финализатор splitmix64), чтобы близкие ключи
+    // равномерно распределялись по корзинам
+    std::size_t operator()(PositionKey key) const noexcept {
+        key ^= key >> 30;
+        key *= 0xBF58476D1CE4E5B9ull;
+        key ^= key >> 27;
+        key *= 0x94D049BB133111EBull;
+        key ^= key >> 31;
+        return static_cast<std::size_t>(key);
+    }
+};
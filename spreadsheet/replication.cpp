@@ -0,0 +1,346 @@
+#include "replication.h"
+
+#include "cell.h"
+#include "position_key.h"
+#include "sheet.h"
+
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+enum class RecordType : std::uint8_t {
+    Text = 1,
+    Formula = 2,
+    Clear = 3,
+    LineChange = 4,
+};
+
+// Вставка или удаление строк и столбцов
+struct LineStep {
+    ReplicationLog::LineChange change;
+    int first;
+    int count;
+};
+
+template <typename T>
+void Put(std::string& buffer, T value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    buffer.append(bytes, sizeof(T));
+}
+
+void PutPosition(std::string& buffer, Position pos) {
+    Put<std::int32_t>(buffer, pos.row);
+    Put<std::int32_t>(buffer, pos.col);
+}
+
+// Чтение данных пакета с проверкой границ
+class BatchReader {
+public:
+    explicit BatchReader(std::string_view data)
+    : data_(data) {
+    }
+
+    template <typename T>
+    T Get() {
+        T value;
+        std::memcpy(&value, Take(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    Position GetPosition() {
+        Position pos;
+        pos.row = Get<std::int32_t>();
+        pos.col = Get<std::int32_t>();
+        return pos;
+    }
+
+    std::string_view Take(std::size_t size) {
+        if (size > data_.size()) {
+            throw ReplicationException("Replication batch is truncated");
+        }
+        std::string_view result = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return result;
+    }
+
+    bool AtEnd() const {
+        return data_.empty();
+    }
+
+private:
+    std::string_view data_;
+};
+
+// Проверяет программу формулы так же, как BuildFormulaAST, но без
+// построения дерева: после проверки MakeFormula не бросает исключений
+void ValidateProgram(const FormulaProgram& program) {
+    using Code = FormulaInstruction::Code;
+    std::size_t depth = 0;
+    for (const FormulaInstruction& instruction : program) {
+        switch (instruction.code) {
+            case Code::Cell:
+                if (!instruction.cell.IsValid()) {
+                    throw ReplicationException("Invalid position in replicated formula");
+                }
+                [[fallthrough]];
+            case Code::Number:
+            case Code::RefError:
+                ++depth;
+                break;
+            case Code::Negate:
+            case Code::Plus:
+                if (depth < 1) {
+                    throw ReplicationException("Invalid replicated formula");
+                }
+                break;
+            default:
+                if (depth < 2) {
+                    throw ReplicationException("Invalid replicated formula");
+                }
+                --depth;
+                break;
+        }
+    }
+    if (depth != 1) {
+        throw ReplicationException("Invalid replicated formula");
+    }
+}
+
+}  // namespace
+
+//--------------------ReplicationLog-----------------------
+
+ReplicationLog::ReplicationLog(std::ostream& output)
+: output_(output) {
+}
+
+void ReplicationLog::AddCell(Position pos, const Cell& cell) {
+    if (const FormulaProgram* program = cell.GetProgram()) {
+        Put(buffer_, RecordType::Formula);
+        PutPosition(buffer_, pos);
+        Put<std::uint32_t>(buffer_, static_cast<std::uint32_t>(program->size()));
+        for (const FormulaInstruction& instruction : *program) {
+            Put(buffer_, instruction.code);
+            if (instruction.code == FormulaInstruction::Code::Number) {
+                Put(buffer_, instruction.number);
+            } else if (instruction.code == FormulaInstruction::Code::Cell) {
+                PutPosition(buffer_, instruction.cell);
+            }
+        }
+    } else {
+        const std::string text = cell.GetText();
+        Put(buffer_, RecordType::Text);
+        PutPosition(buffer_, pos);
+        Put<std::uint32_t>(buffer_, static_cast<std::uint32_t>(text.size()));
+        buffer_ += text;
+    }
+}
+
+void ReplicationLog::AddClear(Range range) {
+    Put(buffer_, RecordType::Clear);
+    PutPosition(buffer_, range.top_left);
+    Put<std::int32_t>(buffer_, range.size.rows);
+    Put<std::int32_t>(buffer_, range.size.cols);
+}
+
+void ReplicationLog::AddLineChange(LineChange change, int first, int count) {
+    Put(buffer_, RecordType::LineChange);
+    Put(buffer_, change);
+    Put<std::int32_t>(buffer_, first);
+    Put<std::int32_t>(buffer_, count);
+}
+
+void ReplicationLog::EndChange() {
+    ++version_;
+}
+
+void ReplicationLog::Flush() {
+    if (version_ == flushed_version_) {
+        return;
+    }
+    if (buffer_.size() > std::numeric_limits<std::uint32_t>::max()) {
+        throw ReplicationException("Replication batch exceeds 4 GiB");
+    }
+    std::string header;
+    Put<std::uint64_t>(header, version_);
+    Put<std::uint32_t>(header, static_cast<std::uint32_t>(buffer_.size()));
+    output_.write(header.data(), static_cast<std::streamsize>(header.size()));
+    output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    output_.flush();
+    buffer_.clear();
+    flushed_version_ = version_;
+}
+
+std::uint64_t ReplicationLog::GetVersion() const {
+    return version_;
+}
+
+//---------------------ReplicaReader-----------------------
+
+ReplicaReader::ReplicaReader(Sheet& sheet, std::istream& input)
+: sheet_(sheet)
+, input_(input) {
+}
+
+bool ReplicaReader::ApplyBatch() {
+    char header[sizeof(std::uint64_t) + sizeof(std::uint32_t)];
+    input_.read(header, sizeof(header));
+    if (input_.gcount() == 0) {
+        return false;
+    }
+    if (input_.gcount() != static_cast<std::streamsize>(sizeof(header))) {
+        throw ReplicationException("Replication batch header is truncated");
+    }
+    BatchReader header_reader({header, sizeof(header)});
+    const auto version = header_reader.Get<std::uint64_t>();
+    const auto size = header_reader.Get<std::uint32_t>();
+    if (version <= version_) {
+        throw ReplicationException("Replication batch version "s + std::to_string(version)
+            + " does not follow "s + std::to_string(version_));
+    }
+
+    std::string data(size, '\0');
+    input_.read(data.data(), size);
+    if (input_.gcount() != static_cast<std::streamsize>(size)) {
+        throw ReplicationException("Replication batch is truncated");
+    }
+
+    // Разобрать пакет целиком до изменения таблицы. Подряд идущие записи
+    // ячеек объединяются в одно изменение; повторная запись той же ячейки
+    // заменяет предыдущую
+    using Step = std::variant<std::vector<CompiledCell>, Range, LineStep>;
+    std::vector<Step> steps;
+    std::unordered_map<PositionKey, std::size_t> step_cells;
+    auto add_cell = [&](CompiledCell cell) {
+        if (!cell.pos.IsValid()) {
+            throw ReplicationException("Invalid position in replication batch");
+        }
+        if (steps.empty() || !std::holds_alternative<std::vector<CompiledCell>>(steps.back())) {
+            steps.emplace_back(std::vector<CompiledCell>());
+            step_cells.clear();
+        }
+        auto& cells = std::get<std::vector<CompiledCell>>(steps.back());
+        auto [it, inserted] = step_cells.emplace(ToKey(cell.pos), cells.size());
+        if (inserted) {
+            cells.push_back(std::move(cell));
+        } else {
+            cells[it->second] = std::move(cell);
+        }
+    };
+
+    BatchReader reader(data);
+    while (!reader.AtEnd()) {
+        const auto type = reader.Get<RecordType>();
+        if (type == RecordType::Text) {
+            CompiledCell cell;
+            cell.pos = reader.GetPosition();
+            cell.text = reader.Take(reader.Get<std::uint32_t>());
+            add_cell(std::move(cell));
+        } else if (type == RecordType::Formula) {
+            CompiledCell cell;
+            cell.pos = reader.GetPosition();
+            const auto count = reader.Get<std::uint32_t>();
+            for (std::uint32_t i = 0; i < count; ++i) {
+                FormulaInstruction instruction;
+                const auto code = reader.Get<std::uint8_t>();
+                if (code > static_cast<std::uint8_t>(FormulaInstruction::Code::Plus)) {
+                    throw ReplicationException("Unknown formula instruction in replication batch");
+                }
+                instruction.code = static_cast<FormulaInstruction::Code>(code);
+                if (instruction.code == FormulaInstruction::Code::Number) {
+                    instruction.number = reader.Get<double>();
+                } else if (instruction.code == FormulaInstruction::Code::Cell) {
+                    instruction.cell = reader.GetPosition();
+                }
+                cell.program.push_back(instruction);
+            }
+            ValidateProgram(cell.program);
+            add_cell(std::move(cell));
+        } else if (type == RecordType::Clear) {
+            Range range;
+            range.top_left = reader.GetPosition();
+            range.size.rows = reader.Get<std::int32_t>();
+            range.size.cols = reader.Get<std::int32_t>();
+            if (!range.IsValid()) {
+                throw ReplicationException("Invalid range in replication batch");
+            }
+            steps.emplace_back(range);
+        } else if (type == RecordType::LineChange) {
+            using LineChange = ReplicationLog::LineChange;
+            LineStep line;
+            const auto change = reader.Get<std::uint8_t>();
+            if (change > static_cast<std::uint8_t>(LineChange::DeleteCols)) {
+                throw ReplicationException("Unknown line change in replication batch");
+            }
+            line.change = static_cast<LineChange>(change);
+            line.first = reader.Get<std::int32_t>();
+            line.count = reader.Get<std::int32_t>();
+            const bool rows = line.change == LineChange::InsertRows
+                || line.change == LineChange::DeleteRows;
+            const int max = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+            if (line.first < 0 || line.first >= max || line.count <= 0
+                || line.count > max - line.first) {
+                throw ReplicationException("Invalid line change in replication batch");
+            }
+            steps.emplace_back(line);
+        } else {
+            throw ReplicationException("Unknown record in replication batch");
+        }
+    }
+
+    for (Step& step : steps) {
+        if (auto* cells = std::get_if<std::vector<CompiledCell>>(&step)) {
+            sheet_.SetCompiledCells(std::move(*cells), /* keep_empty_cells = */ true);
+        } else if (const auto* range = std::get_if<Range>(&step)) {
+            // Очистку одной ячейки записывают ClearCell и удаление ячейки при
+            // SetCells: в отличие от ClearRange, они удаляют и пустую ячейку
+            if (range->size == Size{1, 1}) {
+                sheet_.ClearCell(range->top_left);
+            } else {
+                sheet_.ClearRange(*range);
+            }
+        } else {
+            const auto& line = std::get<LineStep>(step);
+            switch (line.change) {
+                case ReplicationLog::LineChange::InsertRows:
+                    sheet_.InsertRows(line.first, line.count);
+                    break;
+                case ReplicationLog::LineChange::InsertCols:
+                    sheet_.InsertCols(line.first, line.count);
+                    break;
+                case ReplicationLog::LineChange::DeleteRows:
+                    sheet_.DeleteRows(line.first, line.count);
+                    break;
+                case ReplicationLog::LineChange::DeleteCols:
+                    sheet_.DeleteCols(line.first, line.count);
+                    break;
+            }
+        }
+    }
+    version_ = version;
+    return true;
+}
+
+bool ReplicaReader::CatchUp(std::uint64_t version) {
+    while (version_ < version) {
+        if (!ApplyBatch()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::uint64_t ReplicaReader::GetVersion() const {
+    return version_;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+class Cell;
+class Sheet;
+
+// Исключение, выбрасываемое при чтении повреждённого или оборванного пакета
+// журнала репликации
+class ReplicationException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Журнал репликации ведущей таблицы. Таблица, к которой подключён журнал
+// (см. Sheet::SetReplicationLog), записывает в него каждое успешное
+// изменение ячеек в уже разобранном виде: формулы - программами (см.
+// FormulaProgram), тексты - как есть, очистку - областями, вставку и
+// удаление строк и столбцов - операциями. Каждое изменение получает
+// следующий номер версии. Flush отправляет накопленные изменения в
+// поток одним пакетом, ReplicaReader применяет пакеты к реплике. Поток может
+// быть файлом, каналом или сокетом.
+//
+// Пакет: версия после пакета (u64), длина данных (u32) и записи подряд:
+//   1, строка, столбец (i32), длина (u32), байты   - текстовая ячейка;
+//   2, строка, столбец (i32), число команд (u32),
+//      команды: код (u8), для Number - число (f64),
+//      для Cell - строка и столбец (i32)           - формула;
+//   3, строка, столбец, число строк и столбцов (i32) - очистка области;
+//   4, операция (u8, см. LineChange), первая строка или столбец,
+//      их число (i32)                                 - вставка или удаление
+//                                                       строк и столбцов.
+// Тип записи - u8, числа - в порядке байтов платформы.
+class ReplicationLog {
+public:
+    enum class LineChange : std::uint8_t {
+        InsertRows,
+        InsertCols,
+        DeleteRows,
+        DeleteCols,
+    };
+
+    explicit ReplicationLog(std::ostream& output);
+
+    // Вызываются Sheet: записывают изменение ячейки, очистку области или
+    // вставку и удаление строк и столбцов и завершают изменение таблицы
+    void AddCell(Position pos, const Cell& cell);
+    void AddClear(Range range);
+    void AddLineChange(LineChange change, int first, int count);
+    void EndChange();
+
+    // Записывает изменения с прошлого вызова одним пакетом. Пустой пакет не
+    // записывается
+    void Flush();
+
+    // Версия последнего завершённого изменения
+    std::uint64_t GetVersion() const;
+
+private:
+    std::ostream& output_;
+    std::string buffer_;
+    std::uint64_t version_ = 0;
+    std::uint64_t flushed_version_ = 0;
+};
+
+// Применяет пакеты журнала репликации к таблице-реплике. Перед первым
+// пакетом реплика должна совпадать с ведущей таблицей на момент подключения
+// журнала. Пакет разбирается целиком, затем его изменения применяются по
+// порядку: ячейки задаются через Sheet::SetCompiledCells без разбора
+// формул, одним обновлением графа на каждую последовательность записей
+// ячеек. Между успешными вызовами таблица соответствует версии GetVersion
+// ведущей таблицы.
+class ReplicaReader {
+public:
+    ReplicaReader(Sheet& sheet, std::istream& input);
+
+    // Читает и применяет один пакет. Возвращает false, если поток закончился
+    // до начала пакета. Бросает ReplicationException, если пакет повреждён
+    // или оборван; пакет разбирается до изменения таблицы, поэтому в этом
+    // случае таблица не изменяется. Исключение таблицы при применении
+    // (например, если реплика не совпадала с ведущей таблицей) оставляет
+    // пакет применённым частично: изменения до ошибки остаются, версия
+    // реплики не меняется.
+    bool ApplyBatch();
+
+    // Применяет пакеты, пока версия не достигнет version. Возвращает false,
+    // если поток закончился раньше
+    bool CatchUp(std::uint64_t version);
+
+    std::uint64_t GetVersion() const;
+
+private:
+    Sheet& sheet_;
+    std::istream& input_;
+    std::uint64_t version_ = 0;
+};
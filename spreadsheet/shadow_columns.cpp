@@ -0,0 +1,115 @@
+#include "shadow_columns.h"
+
+#include "formula_program.h"
+
+#include <algorithm>
+
+std::pair<ShadowStatus, double> ShadowColumns::Classify(CellInterface::ValueView value,
+                                                        bool text) {
+    auto argument = ToFormulaArgument(value);
+    if (std::holds_alternative<double>(argument)) {
+        return {text ? ShadowStatus::NumericText : ShadowStatus::Number,
+                std::get<double>(argument)};
+    }
+    if (text) {
+        return {ShadowStatus::Text, 0.0};
+    }
+    switch (std::get<FormulaError>(argument).GetCategory()) {
+        case FormulaError::Category::Ref:
+            return {ShadowStatus::RefError, 0.0};
+        case FormulaError::Category::Value:
+            return {ShadowStatus::ValueError, 0.0};
+        default:
+            return {ShadowStatus::ArithmeticError, 0.0};
+    }
+}
+
+void ShadowColumns::Set(Position pos, ShadowStatus status, double value, std::string_view text) {
+    const std::size_t index = pos.row / SEGMENT_ROWS;
+    const int row = pos.row % SEGMENT_ROWS;
+
+    auto column_it = columns_.find(pos.col);
+    if (column_it == columns_.end()) {
+        if (status == ShadowStatus::Empty) {
+            return;
+        }
+        column_it = columns_.emplace(pos.col, Column{}).first;
+    }
+    Column& column = column_it->second;
+    if (column.size() <= index) {
+        if (status == ShadowStatus::Empty) {
+            return;
+        }
+        column.resize(index + 1);
+    }
+    std::unique_ptr<Segment>& segment = column[index];
+    if (!segment) {
+        if (status == ShadowStatus::Empty) {
+            return;
+        }
+        segment = std::make_unique<Segment>();
+    }
+
+    const bool was_empty = segment->statuses[row] == ShadowStatus::Empty;
+    const bool empty = status == ShadowStatus::Empty;
+    segment->statuses[row] = status;
+    segment->values[row] = empty ? 0.0 : value;
+    const bool is_text = status == ShadowStatus::Text || status == ShadowStatus::NumericText;
+    if (is_text && !segment->texts) {
+        segment->texts = std::make_unique<std::array<std::string_view, SEGMENT_ROWS>>();
+    }
+    if (segment->texts) {
+        (*segment->texts)[row] = is_text ? text : std::string_view();
+    }
+    segment->non_empty += static_cast<int>(was_empty) - static_cast<int>(empty);
+
+    if (segment->non_empty == 0) {
+        segment.reset();
+        while (!column.empty() && !column.back()) {
+            column.pop_back();
+        }
+        if (column.empty()) {
+            columns_.erase(column_it);
+        }
+    }
+}
+
+const ShadowColumns::Segment* ShadowColumns::FindSegment(Position pos) const {
+    auto column_it = columns_.find(pos.col);
+    if (column_it == columns_.end()) {
+        return nullptr;
+    }
+    const std::size_t index = pos.row / SEGMENT_ROWS;
+    const Column& column = column_it->second;
+    return index < column.size() ? column[index].get() : nullptr;
+}
+
+ShadowStatus ShadowColumns::GetStatus(Position pos) const {
+    const Segment* segment = FindSegment(pos);
+    return segment ? segment->statuses[pos.row % SEGMENT_ROWS] : ShadowStatus::Empty;
+}
+
+void ShadowColumns::Read(Position first, std::size_t count, double* values,
+                         ShadowStatus* statuses, std::string_view* texts) const {
+    std::size_t done = 0;
+    while (done < count) {
+        const Position pos{first.row + static_cast<int>(done), first.col};
+        const int offset = pos.row % SEGMENT_ROWS;
+        const std::size_t chunk = std::min(count - done,
+                                           static_cast<std::size_t>(SEGMENT_ROWS - offset));
+        const Segment* segment = FindSegment(pos);
+        if (segment) {
+            std::copy_n(segment->values.begin() + offset, chunk, values + done);
+            std::copy_n(segment->statuses.begin() + offset, chunk, statuses + done);
+        } else {
+            std::fill_n(values + done, chunk, 0.0);
+            std::fill_n(statuses + done, chunk, ShadowStatus::Empty);
+        }
+        if (texts && segment && segment->texts) {
+            std::copy_n(segment->texts->begin() + offset, chunk, texts + done);
+        } else if (texts) {
+            std::fill_n(texts + done, chunk, std::string_view());
+        }
+        done += chunk;
+    }
+}
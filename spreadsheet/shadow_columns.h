@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Значение ячейки в том виде, в котором его видят формулы
+enum class ShadowStatus : std::uint8_t {
+    Empty,            // ячейки нет или она пустая: в формулах ноль
+    Number,           // значение формулы
+    NumericText,      // текст, который в формулах трактуется как число
+    Text,             // текст, не являющийся числом: в формулах #VALUE!
+    RefError,         // значение формулы - ошибка #REF!
+    ValueError,       // значение формулы - ошибка #VALUE!
+    ArithmeticError,  // значение формулы - ошибка #ARITHM!
+    Stale,            // значение формулы не вычислено или могло устареть
+};
+
+// Теневое хранилище значений ячеек по столбцам: плотный массив чисел и
+// массив статусов. Нужно, чтобы векторные ядра и экспорт читали подряд
+// идущую память, а не обходили ячейки в куче. Столбец разбит на отрезки по
+// SEGMENT_ROWS строк, которые создаются при первой записи и удаляются,
+// когда все их ячейки снова становятся пустыми.
+class ShadowColumns {
+public:
+    static constexpr int SEGMENT_ROWS = 256;
+
+    // Статус и число для значения ячейки. text - значение текстовой ячейки,
+    // а не формулы
+    static std::pair<ShadowStatus, double> Classify(CellInterface::ValueView value, bool text);
+
+    // text - значение текстовой ячейки для статусов Text и NumericText:
+    // строка должна жить, пока ячейка не изменится
+    void Set(Position pos, ShadowStatus status, double value = 0.0, std::string_view text = {});
+
+    ShadowStatus GetStatus(Position pos) const;
+
+    // Копирует отрезок столбца в values и statuses, а если texts не nullptr -
+    // строки текстовых ячеек в texts (для остальных - пустые строки)
+    void Read(Position first, std::size_t count, double* values, ShadowStatus* statuses,
+              std::string_view* texts = nullptr) const;
+
+    // Обходит ячейки со статусом Stale по столбцам слева направо, внутри
+    // столбца сверху вниз. Функция вызывается с аргументом Position
+    template <typename Func>
+    void ForEachStale(Func func) const;
+
+private:
+    struct Segment {
+        std::array<double, SEGMENT_ROWS> values{};
+        std::array<ShadowStatus, SEGMENT_ROWS> statuses{};
+        // Создаётся при записи первой текстовой ячейки отрезка
+        std::unique_ptr<std::array<std::string_view, SEGMENT_ROWS>> texts;
+        int non_empty = 0;
+    };
+    using Column = std::vector<std::unique_ptr<Segment>>;
+
+    const Segment* FindSegment(Position pos) const;
+
+    std::map<int, Column> columns_;
+};
+
+template <typename Func>
+void ShadowColumns::ForEachStale(Func func) const {
+    for (const auto& [col, column] : columns_) {
+        for (std::size_t index = 0; index < column.size(); ++index) {
+            const Segment* segment = column[index].get();
+            if (!segment) {
+                continue;
+            }
+            for (int i = 0; i < SEGMENT_ROWS; ++i) {
+                if (segment->statuses[i] == ShadowStatus::Stale) {
+                    func(Position{static_cast<int>(index) * SEGMENT_ROWS + i, col});
+                }
+            }
+        }
+    }
+}
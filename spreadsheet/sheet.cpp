@@ -1,13 +1,22 @@
 #include "sheet.h"
 
 #include "cell.h"
+#include "column_kernel.h"
 #include "common.h"
+#include "position_key.h"
+#include "replication.h"
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <exception>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <optional>
+#include <sstream>
+#include <thread>
+#include <tuple>
 
 using namespace std::literals;
 
@@ -26,49 +35,60 @@ public:
     bool Contains(Position cell) const;
     void AddCell(Position cell);
     void RemoveCell(Position cell);
+    void RemoveDependencies(Position from);
+    void RemoveCellIfIsolated(Position cell);
+    void MoveCells(const std::vector<std::pair<Position, Position>>& moves);
+    bool HasDependents(Position cell) const;
+    template <typename Func>
+    void ForEachDependent(Position cell, Func func) const;
     bool CheckCyclicDependencies(Position cell);
+    bool HasCycle(const std::vector<Position>& cells) const;
     void ResetCache(Position cell, std::function<void(Position)>& reseter);
+    void ResetCache(const std::vector<Position>& cells, std::function<void(Position)>& reseter);
+    std::vector<Position> GetTopologicalOrder(const std::vector<Position>& cells) const;
+    void Compact();
 
 private:
-    struct PositionHasher {
-        std::size_t operator()(Position p) const noexcept {
-            return p.row * Position::MAX_ROWS + p.col;
-        }
-    };
-    std::unordered_map<Position, Node, PositionHasher> nodes_;
+    std::unordered_map<PositionKey, Node, PositionKeyHasher> nodes_;
+
+    Node& GetNode(Position cell);
 };
 
+DependencyGraph::Node& DependencyGraph::GetNode(Position cell) {
+    auto it = nodes_.find(ToKey(cell));
+    assert(it != nodes_.end());
+    return it->second;
+}
+
 void DependencyGraph::AddDependency(Position from, Position to) {
-    assert(nodes_.count(from));
-    assert(nodes_.count(to));
+    Node& node_from = GetNode(from);
+    Node& node_to = GetNode(to);
 
-    nodes_[from].forward_.insert(&nodes_[to]);
-    nodes_[to].backward_.insert(&nodes_[from]);
+    node_from.forward_.insert(&node_to);
+    node_to.backward_.insert(&node_from);
 }
 
 void DependencyGraph::RemoveDependency(Position from, Position to) {
-    auto it_from = nodes_.find(from);
-    auto it_to = nodes_.find(to);
-
-    assert(it_from != nodes_.end());
-    assert(it_to != nodes_.end());
+    Node& node_from = GetNode(from);
+    Node& node_to = GetNode(to);
 
-    it_from->second.forward_.erase(&nodes_[to]);
-    it_to->second.backward_.erase(&nodes_[from]);
+    node_from.forward_.erase(&node_to);
+    node_to.backward_.erase(&node_from);
 }
 
 bool DependencyGraph::Contains(Position cell) const {
-    return nodes_.find(cell) != nodes_.end();
+    return nodes_.find(ToKey(cell)) != nodes_.end();
 }
 
 void DependencyGraph::AddCell(Position cell) {
-    if (!Contains(cell)) {
-        nodes_[cell].cell_ = cell;
+    auto [it, inserted] = nodes_.try_emplace(ToKey(cell));
+    if (inserted) {
+        it->second.cell_ = cell;
     }
 }
 
 void DependencyGraph::RemoveCell(Position cell) {
-    auto it = nodes_.find(cell);
+    auto it = nodes_.find(ToKey(cell));
     if (it != nodes_.end()) {
         for (auto& forward_node : it->second.forward_) {
             forward_node->backward_.erase(&it->second);
@@ -80,49 +100,188 @@ void DependencyGraph::RemoveCell(Position cell) {
     }
 }
 
+void DependencyGraph::RemoveDependencies(Position from) {
+    auto it = nodes_.find(ToKey(from));
+    if (it != nodes_.end()) {
+        for (auto& forward_node : it->second.forward_) {
+            forward_node->backward_.erase(&it->second);
+        }
+        it->second.forward_.clear();
+    }
+}
+
+void DependencyGraph::RemoveCellIfIsolated(Position cell) {
+    auto it = nodes_.find(ToKey(cell));
+    if (it != nodes_.end() && it->second.forward_.empty() && it->second.backward_.empty()) {
+        nodes_.erase(it);
+    }
+}
+
+void DependencyGraph::MoveCells(const std::vector<std::pair<Position, Position>>& moves) {
+    // Узлы переносятся под новые ключи без копирования, поэтому указатели
+    // рёбер на них остаются действительными. Сначала извлекаются все узлы:
+    // новая позиция может быть занята ещё не перенесённым узлом
+    std::vector<decltype(nodes_)::node_type> handles;
+    for (auto [from, to] : moves) {
+        auto handle = nodes_.extract(ToKey(from));
+        if (!handle.empty()) {
+            handle.key() = ToKey(to);
+            handle.mapped().cell_ = to;
+            handles.push_back(std::move(handle));
+        }
+    }
+    for (auto& handle : handles) {
+        nodes_.insert(std::move(handle));
+    }
+}
+
+bool DependencyGraph::HasDependents(Position cell) const {
+    auto it = nodes_.find(ToKey(cell));
+    return it != nodes_.end() && !it->second.backward_.empty();
+}
+
+template <typename Func>
+void DependencyGraph::ForEachDependent(Position cell, Func func) const {
+    auto it = nodes_.find(ToKey(cell));
+    if (it != nodes_.end()) {
+        for (const Node* node : it->second.backward_) {
+            func(node->cell_);
+        }
+    }
+}
+
 bool DependencyGraph::CheckCyclicDependencies(Position cell) {
+    // Обход в глубину с явным стеком: длина цепочки зависимостей не
+    // ограничена размером стека вызовов
     std::unordered_set<const Node*> verified_nodes;
-    auto it = nodes_.find(cell);
-    assert(it != nodes_.end());
-    const Node* start_node = &it->second;
+    const Node* start_node = &GetNode(cell);
+    std::vector<const Node*> stack{start_node};
 
-    std::function<bool(const Node*)> check_node = [&](const Node* current) {
+    while (!stack.empty()) {
+        const Node* current = stack.back();
+        stack.pop_back();
         for (const Node* next_node : current->forward_) {
-            if (verified_nodes.count(next_node)) {
-                continue;
-            }
             if (next_node == start_node) {
                 return false;
-            } else {
-                if (!check_node(next_node)) {
-                    return false;
-                } else {
-                    verified_nodes.insert(next_node);
-                }
+            }
+            if (verified_nodes.insert(next_node).second) {
+                stack.push_back(next_node);
             }
         }
-        return true; // циклических зависимостей нет
+    }
+    return true; // циклических зависимостей нет
+}
+
+bool DependencyGraph::HasCycle(const std::vector<Position>& cells) const {
+    // Один обход в глубину по зависимостям из всех cells. Узел на пути
+    // обхода - серый, обойдённый - чёрный: ребро в серый узел замыкает цикл
+    struct Frame {
+        const Node* node;
+        std::unordered_set<Node*>::const_iterator next;
     };
-    return check_node(start_node);
+    std::unordered_map<const Node*, bool> on_path;
+    std::vector<Frame> stack;
+
+    for (Position cell : cells) {
+        auto it = nodes_.find(ToKey(cell));
+        if (it == nodes_.end() || !on_path.try_emplace(&it->second, true).second) {
+            continue;
+        }
+        stack.push_back({&it->second, it->second.forward_.begin()});
+        while (!stack.empty()) {
+            Frame& top = stack.back();
+            if (top.next != top.node->forward_.end()) {
+                const Node* next_node = *top.next++;
+                auto [state, inserted] = on_path.try_emplace(next_node, true);
+                if (inserted) {
+                    stack.push_back({next_node, next_node->forward_.begin()});
+                } else if (state->second) {
+                    return true;
+                }
+            } else {
+                on_path[top.node] = false;
+                stack.pop_back();
+            }
+        }
+    }
+    return false;
 }
 
 void DependencyGraph::ResetCache(Position cell, std::function<void(Position)>& reseter) {
+    ResetCache(std::vector<Position>{cell}, reseter);
+}
+
+void DependencyGraph::ResetCache(const std::vector<Position>& cells,
+                                 std::function<void(Position)>& reseter) {
+    // Общее множество посещённых узлов: каждая зависимая ячейка
+    // сбрасывается ровно один раз, даже если достижима из нескольких
+    // стартовых
     std::unordered_set<const Node*> verified_nodes;
-    auto it = nodes_.find(cell);
-    assert(it != nodes_.end());
-    const Node* start_node = &it->second;
+    std::vector<const Node*> stack;
+
+    for (Position cell : cells) {
+        const Node* start_node = &GetNode(cell);
+        if (verified_nodes.insert(start_node).second) {
+            stack.push_back(start_node);
+        }
+    }
 
-    std::function<void(const Node*)> reset_node = [&](const Node* current) {
+    while (!stack.empty()) {
+        const Node* current = stack.back();
+        stack.pop_back();
         reseter(current->cell_);
         for (const Node* next_node : current->backward_) {
-            if (verified_nodes.count(next_node)) {
-                continue;
+            if (verified_nodes.insert(next_node).second) {
+                stack.push_back(next_node);
             }
-            reset_node(next_node);
-            verified_nodes.insert(next_node);
         }
+    }
+}
+
+std::vector<Position> DependencyGraph::GetTopologicalOrder(const std::vector<Position>& cells) const {
+    // Обратный порядок выхода из вершин при обходе в глубину по зависимым
+    // ячейкам: каждая ячейка идёт раньше всех ячеек, которые от неё зависят
+    struct Frame {
+        const Node* node;
+        std::unordered_set<Node*>::const_iterator next;
     };
-    reset_node(start_node);
+    std::unordered_set<const Node*> visited_nodes;
+    std::vector<Frame> stack;
+    std::vector<Position> order;
+
+    for (Position cell : cells) {
+        auto it = nodes_.find(ToKey(cell));
+        if (it == nodes_.end() || !visited_nodes.insert(&it->second).second) {
+            continue;
+        }
+        stack.push_back({&it->second, it->second.backward_.begin()});
+        while (!stack.empty()) {
+            Frame& top = stack.back();
+            if (top.next != top.node->backward_.end()) {
+                const Node* next_node = *top.next++;
+                if (visited_nodes.insert(next_node).second) {
+                    stack.push_back({next_node, next_node->backward_.begin()});
+                }
+            } else {
+                order.push_back(top.node->cell_);
+                stack.pop_back();
+            }
+        }
+    }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+void DependencyGraph::Compact() {
+    for (auto it = nodes_.begin(); it != nodes_.end();) {
+        if (it->second.forward_.empty() && it->second.backward_.empty()) {
+            it = nodes_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    nodes_.rehash(0);
 }
 
 //------------------------Sheet----------------------------
@@ -135,12 +294,13 @@ Sheet::~Sheet() {}
 
 void Sheet::SetCell(Position pos, std::string text) {
     ValidatePosition(pos);
+    ++epoch_;
 
     // Создать новую ячейку
     std::unique_ptr<Cell> new_cell = std::make_unique<Cell>(*this);
     new_cell->Set(std::move((text)));
     
-    std::vector<Position> new_poses = new_cell->GetReferencedCells();
+    PositionSpan new_poses = new_cell->GetReferencedCellsView();
     std::vector<Position> new_empty_poses;
     for (Position next : new_poses) {
         if (next == pos) {
@@ -158,11 +318,11 @@ void Sheet::SetCell(Position pos, std::string text) {
     }
 
     bool contained = graph_->Contains(pos);
-    std::vector<Position> old_poses;
+    PositionSpan old_poses;
     if (contained) {
         Cell* old_cell = GetConcreteCell(pos);
         assert(old_cell);
-        old_poses = old_cell->GetReferencedCells();
+        old_poses = old_cell->GetReferencedCellsView();
 
         // Удалить зависимости старой ячейки с графа
         for (Position next : old_poses) {
@@ -181,9 +341,13 @@ void Sheet::SetCell(Position pos, std::string text) {
 
     if (contained) {
         if (!graph_->CheckCyclicDependencies(pos)) {
+            // Удалить зависимости новой ячейки с графа
+            graph_->RemoveDependencies(pos);
+
             // Удалить временно созданные пустые ячейки с листа
             for (Position next : new_empty_poses) {
-                ClearCell(next);
+                graph_->RemoveCell(next);
+                RemoveCell(next);
             }
 
             // Вернуть зависимости старой ячейки
@@ -193,23 +357,46 @@ void Sheet::SetCell(Position pos, std::string text) {
             }
             std::string msg = "Attempt to add a cell resulted in circular references";
             throw CircularDependencyException(msg);
-        } else {
+        } else if (recalculation_mode_ == RecalculationMode::Lazy) {
             
-            // callback функция для сброса кэша ячейки
-            std::function<void(Position)> reseter
-                = [this](Position pos) {
-                    const Cell* cell_ = this->GetConcreteCell(pos);
-                    assert(cell_);
-                    cell_->ResetCache();
-                };
-
             // Сбросить кэш
-            graph_->ResetCache(pos, reseter);
+            InvalidateDependents({pos});
         }
     }
 
-    // Заменить старую ячейку на новую в листе
-    PlaceCell(pos, std::move(new_cell));
+    // Значение старой ячейки нужно сохранить до замены: новая ячейка займёт
+    // её место в кэше хранилища. Строка значения принадлежит старой ячейке
+    const CellValue old_value = contained ? GetConcreteCell(pos)->PeekCache() : CellValue();
+
+    // Заменить старую ячейку на новую в листе. Старая ячейка живёт до конца
+    // метода: old_poses ссылается на её формулу
+    const Cell* placed_cell = new_cell.get();
+    std::unique_ptr<Cell> old_cell = PlaceCell(pos, std::move(new_cell));
+
+    if (contained && recalculation_mode_ == RecalculationMode::Eager) {
+        // Повторно введённое то же значение не пересчитывает зависимые
+        const bool changed = placed_cell->Recalculate(old_value);
+        SyncShadow(pos);
+        if (changed) {
+            PropagateChanges({pos});
+        }
+    }
+
+    if (replication_log_) {
+        replication_log_->AddCell(pos, *placed_cell);
+        replication_log_->EndChange();
+    }
+    if (undo_limit_ > 0) {
+        HistoryEntry entry;
+        entry.Add(pos, old_cell.get());
+        RecordUndo(std::move(entry));
+    }
+
+    // Удалить ячейки-заглушки, на которые ссылалась только старая ячейка
+    graph_->RemoveCellIfIsolated(pos);
+    for (Position next : old_poses) {
+        ReclaimIfOrphan(next);
+    }
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -226,74 +413,1004 @@ const Cell* Sheet::GetConcreteCell(Position pos) const {
 }
 
 Cell* Sheet::GetConcreteCell(Position pos) {
-    if (pos.row < static_cast<int>(cells_.size())) {
-        std::vector<std::unique_ptr<Cell>>& row = cells_[pos.row];
-        if (pos.col < static_cast<int>(row.size())) {
-            return row[pos.col].get();
-        }
-    }
-    return nullptr;
+    return cells_.Get(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     ValidatePosition(pos);
 
-    if (pos.row < static_cast<int>(cells_.size())) {
-        std::vector<std::unique_ptr<Cell>>& row = cells_[pos.row];
-        if (pos.col < static_cast<int>(row.size())) {
-            row[pos.col].reset();
-            if (pos.row + 1 == printable_size_.rows || pos.col + 1 == printable_size_.cols) {
-                for (int r = printable_size_.rows; r >= 0; --r) {
-                    std::vector<std::unique_ptr<Cell>>& row = cells_[r];
-                    for (int c = printable_size_.cols; c >= 0; --c) {
-                        if (c < static_cast<int>(row.size()) && row[c] != nullptr) {
-                            printable_size_ = {r + 1, c + 1};
-                            return;
-                        }
-                    }
-                }
-                printable_size_ = {0, 0};
+    if (!GetConcreteCell(pos)) {
+        return;
+    }
+    ClearCells({pos});
+    if (replication_log_) {
+        replication_log_->AddClear({pos, {1, 1}});
+        replication_log_->EndChange();
+    }
+}
+
+void Sheet::ClearRange(Range range) {
+    ValidateRange(range);
+
+    // Собрать непустые ячейки области за один проход. Пустые ячейки-заглушки
+    // в области остаются, пока на них ссылаются формулы
+    std::vector<Position> cleared;
+    ForEachCellInRange(range, [&cleared](Position pos, const Cell&) {
+        cleared.push_back(pos);
+    });
+
+    if (!cleared.empty()) {
+        ClearCells(cleared);
+        if (replication_log_) {
+            replication_log_->AddClear(range);
+            replication_log_->EndChange();
+        }
+    }
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    // Разобрать все тексты до изменения таблицы
+    std::vector<std::pair<Position, std::unique_ptr<Cell>>> new_cells;
+    for (auto& [pos, text] : cells) {
+        ValidatePosition(pos);
+        auto new_cell = std::make_unique<Cell>(*this);
+        new_cell->Set(std::move(text));
+        new_cells.emplace_back(pos, std::move(new_cell));
+    }
+    PlaceCells(std::move(new_cells));
+}
+
+void Sheet::SetCompiledCells(std::vector<CompiledCell> cells, bool keep_empty_cells) {
+    PlaceCells(BuildCells(std::move(cells)), /* record_undo = */ true, keep_empty_cells);
+}
+
+namespace {
+// Программа формулы, скопированной на offset строк и столбцов
+FormulaProgram ShiftProgram(const FormulaProgram& program, Position offset) {
+    FormulaProgram result = program;
+    for (FormulaInstruction& instruction : result) {
+        if (instruction.code == FormulaInstruction::Code::Cell) {
+            instruction.cell.row += offset.row;
+            instruction.cell.col += offset.col;
+            if (!instruction.cell.IsValid()) {
+                instruction.code = FormulaInstruction::Code::RefError;
+                instruction.cell = Position::NONE;
             }
         }
-    }    
+    }
+    return result;
 }
+}  // namespace
 
-Size Sheet::GetPrintableSize() const {
-    return printable_size_;
+void Sheet::CopyRange(Range source, Position destination) {
+    ValidateRange(source);
+    const Range target{destination, source.size};
+    ValidateRange(target);
+    const Position offset{destination.row - source.top_left.row,
+                          destination.col - source.top_left.col};
+
+    // Содержимое источника читается целиком до изменения таблицы
+    std::vector<CompiledCell> cells;
+    std::unordered_set<PositionKey> copied;
+    ForEachCellInRange(source, [&](Position pos, const Cell& cell) {
+        CompiledCell copy;
+        copy.pos = {pos.row + offset.row, pos.col + offset.col};
+        if (const FormulaProgram* program = cell.GetProgram()) {
+            copy.program = ShiftProgram(*program, offset);
+        } else {
+            copy.text = cell.GetText();
+        }
+        copied.insert(ToKey(copy.pos));
+        cells.push_back(std::move(copy));
+    });
+    ForEachCellInRange(target, [&](Position pos, const Cell&) {
+        if (!copied.count(ToKey(pos))) {
+            CompiledCell clear;
+            clear.pos = pos;
+            cells.push_back(std::move(clear));
+        }
+    });
+
+    PlaceCells(BuildCells(std::move(cells)));
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    for (int r = 0; r < printable_size_.rows; ++r) {
-        const std::vector<std::unique_ptr<Cell>>& row = cells_[r];
-        for (int c = 0; c < printable_size_.cols; ++c) {
-            if (c > 0) {
-                output << "\t";
+std::vector<std::pair<Position, std::unique_ptr<Cell>>> Sheet::BuildCells(
+    std::vector<CompiledCell> cells) {
+    std::vector<std::pair<Position, std::unique_ptr<Cell>>> new_cells;
+    for (CompiledCell& cell : cells) {
+        ValidatePosition(cell.pos);
+        auto new_cell = std::make_unique<Cell>(*this);
+        if (cell.program.empty()) {
+            new_cell->Set(std::move(cell.text));
+        } else {
+            new_cell->SetFormula(cell.program);
+        }
+        new_cells.emplace_back(cell.pos, std::move(new_cell));
+    }
+    return new_cells;
+}
+
+CompiledCell Sheet::ToCompiledCell(Position pos, const Cell* cell) {
+    CompiledCell result;
+    result.pos = pos;
+    if (cell) {
+        if (const FormulaProgram* program = cell->GetProgram()) {
+            result.program = *program;
+        } else {
+            result.text = cell->GetText();
+        }
+    }
+    return result;
+}
+
+void Sheet::HistoryEntry::Add(Position pos, const Cell* cell) {
+    cells.push_back(ToCompiledCell(pos, cell));
+    if (!cell) {
+        absent.push_back(pos);
+    }
+}
+
+void Sheet::SetUndoLimit(std::size_t limit) {
+    undo_limit_ = limit;
+    while (undo_.size() > limit) {
+        undo_.pop_front();
+    }
+    while (redo_.size() > limit) {
+        redo_.pop_front();
+    }
+}
+
+bool Sheet::Undo() {
+    return ApplyHistory(undo_, redo_);
+}
+
+bool Sheet::Redo() {
+    return ApplyHistory(redo_, undo_);
+}
+
+bool Sheet::CanUndo() const {
+    return !undo_.empty();
+}
+
+bool Sheet::CanRedo() const {
+    return !redo_.empty();
+}
+
+void Sheet::RecordUndo(HistoryEntry entry) {
+    redo_.clear();
+    undo_.push_back(std::move(entry));
+    if (undo_.size() > undo_limit_) {
+        undo_.pop_front();
+    }
+}
+
+bool Sheet::ApplyHistory(std::deque<HistoryEntry>& from, std::deque<HistoryEntry>& to) {
+    if (from.empty()) {
+        return false;
+    }
+    HistoryEntry entry = std::move(from.back());
+    from.pop_back();
+
+    // Текущее содержимое тех же ячеек - обратное изменение
+    HistoryEntry current;
+    current.cells.reserve(entry.cells.size());
+    for (const CompiledCell& cell : entry.cells) {
+        current.Add(cell.pos, GetConcreteCell(cell.pos));
+    }
+
+    // Пустые ячейки восстанавливаются так же, как их оставил SetCell
+    PlaceCells(BuildCells(std::move(entry.cells)), /* record_undo = */ false,
+               /* keep_empty_cells = */ true, entry.absent);
+    to.push_back(std::move(current));
+    return true;
+}
+
+void Sheet::PlaceCells(std::vector<std::pair<Position, std::unique_ptr<Cell>>> cells,
+                       bool record_undo, bool keep_empty_cells,
+                       const std::vector<Position>& reclaimed) {
+    struct Edit {
+        Position pos;
+        std::unique_ptr<Cell> cell;
+        PositionSpan old_poses;
+    };
+    std::unordered_set<PositionKey> edited;
+    std::vector<Edit> edits;
+    std::vector<Position> edited_poses;
+    for (auto& [pos, new_cell] : cells) {
+        if (!edited.insert(ToKey(pos)).second) {
+            throw InvalidPositionException("Duplicate position: "s + pos.ToString());
+        }
+        for (Position next : new_cell->GetReferencedCellsView()) {
+            if (next == pos) {
+                std::string msg = "Сell references itself";
+                throw CircularDependencyException(msg);
+            }
+        }
+        edits.push_back({pos, std::move(new_cell), {}});
+        edited_poses.push_back(pos);
+    }
+    if (edits.empty()) {
+        return;
+    }
+    ++epoch_;
+
+    // Создать пустые ячейки для позиций, на которые ссылаются новые ячейки,
+    // кроме изменяемых
+    std::vector<Position> new_empty_poses;
+    for (const Edit& edit : edits) {
+        for (Position next : edit.cell->GetReferencedCellsView()) {
+            if (!GetConcreteCell(next) && !edited.count(ToKey(next))) {
+                PlaceCell(next, std::make_unique<Cell>(*this));
+                new_empty_poses.push_back(next);
+            }
+        }
+    }
+
+    // Зависимые есть только у ячеек, которые уже были на графе: кэш
+    // сбрасывается и пересчитывается только от них
+    std::vector<Position> contained;
+    for (Position pos : edited_poses) {
+        if (graph_->Contains(pos)) {
+            contained.push_back(pos);
+        }
+    }
+
+    // Заменить зависимости старых ячеек на зависимости новых
+    for (Edit& edit : edits) {
+        if (const Cell* old_cell = GetConcreteCell(edit.pos)) {
+            edit.old_poses = old_cell->GetReferencedCellsView();
+        }
+        graph_->RemoveDependencies(edit.pos);
+    }
+    for (const Edit& edit : edits) {
+        graph_->AddCell(edit.pos);
+        for (Position next : edit.cell->GetReferencedCellsView()) {
+            graph_->AddCell(next);
+            graph_->AddDependency(edit.pos, next);
+        }
+    }
+
+    if (graph_->HasCycle(edited_poses)) {
+        // Вернуть зависимости старых ячеек
+        for (const Edit& edit : edits) {
+            graph_->RemoveDependencies(edit.pos);
+        }
+        for (const Edit& edit : edits) {
+            for (Position next : edit.old_poses) {
+                graph_->AddCell(next);
+                graph_->AddDependency(edit.pos, next);
             }
-            if (c < static_cast<int>(row.size()) && row[c] != nullptr) {
-                Cell::Value value = row[c]->GetValue();
-                std::visit([&output](const auto &elem) { output << elem; }, value);
+        }
+
+        // Удалить временно созданные пустые ячейки и узлы
+        for (Position next : new_empty_poses) {
+            graph_->RemoveCell(next);
+            RemoveCell(next);
+        }
+        for (const Edit& edit : edits) {
+            graph_->RemoveCellIfIsolated(edit.pos);
+            for (Position next : edit.cell->GetReferencedCellsView()) {
+                graph_->RemoveCellIfIsolated(next);
+            }
+        }
+        std::string msg = "Attempt to set cells resulted in circular references";
+        throw CircularDependencyException(msg);
+    }
+
+    // Заменить старые ячейки на новые. Старые ячейки живут до конца метода:
+    // old_poses ссылается на их формулы
+    std::vector<std::unique_ptr<Cell>> old_cells;
+    for (Edit& edit : edits) {
+        old_cells.push_back(PlaceCell(edit.pos, std::move(edit.cell)));
+    }
+    if (record_undo && undo_limit_ > 0) {
+        HistoryEntry entry;
+        entry.cells.reserve(edits.size());
+        for (std::size_t i = 0; i < edits.size(); ++i) {
+            entry.Add(edited_poses[i], old_cells[i].get());
+        }
+        RecordUndo(std::move(entry));
+    }
+
+    // Однократно сбросить кэш изменённых и зависимых от них ячеек. Сброс
+    // помечает теневые значения устаревшими, поэтому значения самих
+    // изменённых ячеек записываются заново
+    if (recalculation_mode_ != RecalculationMode::Epoch) {
+        InvalidateDependents(contained);
+        for (Position pos : contained) {
+            SyncShadow(pos);
+        }
+    }
+    if (recalculation_mode_ == RecalculationMode::Eager) {
+        for (Position pos : graph_->GetTopologicalOrder(contained)) {
+            GetConcreteCell(pos)->GetCachedValue();
+            SyncShadow(pos);
+        }
+    }
+
+    // Удалить ячейки-заглушки, на которые ссылались только старые ячейки, и
+    // очищенные ячейки, на которые никто не ссылается
+    for (const Edit& edit : edits) {
+        graph_->RemoveCellIfIsolated(edit.pos);
+        for (Position next : edit.old_poses) {
+            ReclaimIfOrphan(next);
+        }
+    }
+    for (Position pos : keep_empty_cells ? reclaimed : edited_poses) {
+        const Cell* cell = GetConcreteCell(pos);
+        if (cell && cell->IsEmpty()) {
+            ReclaimIfOrphan(pos);
+        }
+    }
+
+    // Реплика сохраняет пустые ячейки (см. SetCompiledCells), поэтому
+    // удалённые из таблицы ячейки записываются очисткой после всех ячеек
+    if (replication_log_) {
+        std::vector<Position> removed;
+        for (Position pos : edited_poses) {
+            if (const Cell* cell = GetConcreteCell(pos)) {
+                replication_log_->AddCell(pos, *cell);
             } else {
-                output << "";
+                removed.push_back(pos);
             }
         }
-        output << "\n";
+        for (Position pos : removed) {
+            replication_log_->AddClear({pos, {1, 1}});
+        }
+        replication_log_->EndChange();
     }
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    for (int r = 0; r < printable_size_.rows; ++r) {
-        const std::vector<std::unique_ptr<Cell>>& row = cells_[r];
-        for (int c = 0; c < printable_size_.cols; ++c) {
-            if (c > 0) {
-                output << "\t";
+std::vector<CellChange> Sheet::Diff(const Sheet& other) const {
+    std::vector<CellChange> changes;
+    auto text_at = [](const Sheet& sheet, Position pos) {
+        const Cell* cell = sheet.GetConcreteCell(pos);
+        return cell ? cell->GetText() : std::string();
+    };
+    CellStorage::ForEachDifferentBlock(cells_, other.cells_, [&](Position first, Position last) {
+        for (int row = first.row; row <= last.row; ++row) {
+            for (int col = first.col; col <= last.col; ++col) {
+                Position pos{row, col};
+                std::string old_text = text_at(*this, pos);
+                std::string new_text = text_at(other, pos);
+                if (old_text != new_text) {
+                    changes.push_back({pos, std::move(old_text), std::move(new_text)});
+                }
             }
-            if (c < static_cast<int>(row.size()) && row[c] != nullptr) {
-                output << row[c]->GetText();
-            } else {
-                output << "";
+        }
+    });
+
+    std::sort(changes.begin(), changes.end(), [](const CellChange& lhs, const CellChange& rhs) {
+        return lhs.pos < rhs.pos;
+    });
+    return changes;
+}
+
+MergeResult Sheet::Merge(const Sheet& base, const Sheet& theirs) {
+    std::unordered_map<PositionKey, std::string> our_texts;
+    for (CellChange& change : base.Diff(*this)) {
+        our_texts.emplace(ToKey(change.pos), std::move(change.new_text));
+    }
+
+    MergeResult result;
+    std::vector<std::pair<Position, std::string>> edits;
+    for (CellChange& change : base.Diff(theirs)) {
+        auto it = our_texts.find(ToKey(change.pos));
+        if (it == our_texts.end()) {
+            edits.emplace_back(change.pos, change.new_text);
+            result.applied.push_back(std::move(change));
+        } else if (it->second != change.new_text) {
+            result.conflicts.push_back({change.pos, std::move(change.old_text),
+                                        std::move(it->second), std::move(change.new_text)});
+        }
+    }
+
+    SetCells(std::move(edits));
+    return result;
+}
+
+void Sheet::InsertRows(int before, int count) {
+    ShiftLines(&Position::row, before, count, true);
+}
+
+void Sheet::InsertCols(int before, int count) {
+    ShiftLines(&Position::col, before, count, true);
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    ShiftLines(&Position::row, first, count, false);
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    ShiftLines(&Position::col, first, count, false);
+}
+
+void Sheet::ShiftLines(int Position::*axis, int first, int count, bool insert) {
+    const bool rows = axis == &Position::row;
+    const int max = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (first < 0 || first >= max || count <= 0 || count > max - first) {
+        throw InvalidPositionException("Invalid "s + (rows ? "rows"s : "columns"s)
+            + ": first = "s + std::to_string(first) + ", count = "s + std::to_string(count));
+    }
+
+    // Новая позиция ячейки или недействительная позиция, если ячейка
+    // удаляется или уходит за пределы таблицы
+    auto shift = [axis, first, count, insert, max](Position pos) {
+        if (pos.*axis < first) {
+            return pos;
+        }
+        if (insert) {
+            pos.*axis += count;
+            return pos.*axis < max ? pos : Position::NONE;
+        }
+        if (pos.*axis < first + count) {
+            return Position::NONE;
+        }
+        pos.*axis -= count;
+        return pos;
+    };
+    auto handle = [axis, first, count, insert](Cell& cell) {
+        FormulaInterface* formula = cell.GetFormula();
+        if (!formula) {
+            return FormulaInterface::HandlingResult::NothingChanged;
+        }
+        if (axis == &Position::row) {
+            return insert ? formula->HandleInsertedRows(first, count)
+                          : formula->HandleDeletedRows(first, count);
+        }
+        return insert ? formula->HandleInsertedCols(first, count)
+                      : formula->HandleDeletedCols(first, count);
+    };
+
+    // Сдвигаемые ячейки: обходятся только блоки хранилища за строкой
+    // (столбцом) first. Вставка не должна выталкивать за пределы таблицы
+    // непустые ячейки; пустые ячейки-заглушки при этом удаляются
+    std::vector<Position> moved;
+    cells_.ForEachFrom(axis, first, [&](Position pos, const Cell& cell) {
+        if (insert && !cell.IsEmpty() && !shift(pos).IsValid()) {
+            throw InvalidPositionException("Cell "s + pos.ToString()
+                + " would be shifted out of the sheet"s);
+        }
+        moved.push_back(pos);
+    });
+    ++epoch_;
+    undo_.clear();
+    redo_.clear();
+
+    // Формулы на месте, ссылающиеся на сдвигаемые ячейки
+    std::unordered_set<PositionKey> referring_keys;
+    std::vector<Position> referring;
+    for (Position pos : moved) {
+        graph_->ForEachDependent(pos, [&](Position dependent) {
+            if (dependent.*axis < first && referring_keys.insert(ToKey(dependent)).second) {
+                referring.push_back(dependent);
+            }
+        });
+    }
+
+    // Узлы графа переносятся на новые позиции вместе с рёбрами, узлы
+    // удалённых ячеек удаляются вместе с рёбрами к ним
+    std::vector<std::pair<Position, Position>> moves;
+    moves.reserve(moved.size());
+    for (Position pos : moved) {
+        const Position to = shift(pos);
+        if (to.IsValid()) {
+            moves.emplace_back(pos, to);
+        } else {
+            graph_->RemoveCell(pos);
+        }
+    }
+    graph_->MoveCells(moves);
+
+    // Переставить ячейки в хранилище и переписать ссылки формул. Удалённые
+    // ячейки живут до конца метода: по их ссылкам удаляются осиротевшие
+    // заглушки
+    std::vector<std::unique_ptr<Cell>> extracted;
+    extracted.reserve(moved.size());
+    for (Position pos : moved) {
+        extracted.push_back(RemoveCell(pos));
+    }
+    std::vector<Position> changed;
+    std::vector<Position> deleted_refs;
+    for (std::size_t i = 0; i < moved.size(); ++i) {
+        const Position to = shift(moved[i]);
+        std::unique_ptr<Cell>& cell = extracted[i];
+        if (!to.IsValid()) {
+            for (Position next : cell->GetReferencedCellsView()) {
+                deleted_refs.push_back(shift(next));
+            }
+            continue;
+        }
+        if (handle(*cell) == FormulaInterface::HandlingResult::ReferencesChanged) {
+            changed.push_back(to);
+        }
+        PlaceCell(to, std::move(cell));
+    }
+    for (Position pos : referring) {
+        const auto result = handle(*GetConcreteCell(pos));
+        if (result != FormulaInterface::HandlingResult::NothingChanged) {
+            cells_.MarkChanged(pos);
+        }
+        if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+            changed.push_back(pos);
+        }
+    }
+
+    if (replication_log_) {
+        using Change = ReplicationLog::LineChange;
+        replication_log_->AddLineChange(
+            rows ? (insert ? Change::InsertRows : Change::DeleteRows)
+                 : (insert ? Change::InsertCols : Change::DeleteCols),
+            first, count);
+        replication_log_->EndChange();
+    }
+
+    // Значения изменились только у формул, потерявших ссылку. Формула без
+    // ссылок и зависимых отсутствует на графе
+    std::vector<Position> contained;
+    for (Position pos : changed) {
+        GetConcreteCell(pos)->MarkChanged();
+        SyncShadow(pos);
+        if (graph_->Contains(pos)) {
+            contained.push_back(pos);
+        }
+    }
+    if (recalculation_mode_ != RecalculationMode::Epoch) {
+        InvalidateDependents(contained);
+    }
+    if (recalculation_mode_ == RecalculationMode::Eager) {
+        for (Position pos : graph_->GetTopologicalOrder(contained)) {
+            GetConcreteCell(pos)->GetCachedValue();
+            SyncShadow(pos);
+        }
+    }
+
+    // Удалить заглушки, на которые ссылались только удалённые ячейки
+    for (Position pos : deleted_refs) {
+        if (pos.IsValid()) {
+            ReclaimIfOrphan(pos);
+        }
+    }
+}
+
+void Sheet::Compact() {
+    // Удалить пустые ячейки, на которые не ссылается ни одна формула
+    std::vector<Position> orphans;
+    cells_.ForEach([&](Position pos, const Cell& cell) {
+        if (cell.IsEmpty() && !graph_->HasDependents(pos)) {
+            orphans.push_back(pos);
+        }
+    });
+    for (Position pos : orphans) {
+        graph_->RemoveCell(pos);
+        cells_.Extract(pos);
+    }
+    graph_->Compact();
+
+    // Освободить лишние корзины хранилища
+    cells_.Compact();
+}
+
+void Sheet::SetRecalculationMode(RecalculationMode mode) {
+    // Режим Epoch хранит кэш вместе с метками правок, а остальные режимы
+    // сбрасывают кэш сразу при изменении. При переходе между ними кэш
+    // формул сбрасывается целиком, а значения текста от режима не зависят
+    if ((recalculation_mode_ == RecalculationMode::Epoch) != (mode == RecalculationMode::Epoch)) {
+        cells_.ForEach([this](Position pos, const Cell& cell) {
+            if (cell.GetProgram()) {
+                cell.ResetCache();
+                shadow_.Set(pos, ShadowStatus::Stale);
+            }
+        });
+    }
+    recalculation_mode_ = mode;
+}
+
+RecalculationMode Sheet::GetRecalculationMode() const {
+    return recalculation_mode_;
+}
+
+void Sheet::SetNumberFormat(NumberFormat format) {
+    number_format_ = format;
+}
+
+NumberFormat Sheet::GetNumberFormat() const {
+    return number_format_;
+}
+
+void Sheet::SetReplicationLog(ReplicationLog* log) {
+    replication_log_ = log;
+}
+
+std::uint64_t Sheet::GetEpoch() const {
+    return epoch_;
+}
+
+StringPool& Sheet::GetStringPool() const {
+    return strings_;
+}
+
+namespace {
+// Блоки короче этого вычисляются по одной формуле: подготовка ядра не
+// окупается
+const std::size_t MIN_KERNEL_BLOCK = 16;
+}  // namespace
+
+void Sheet::EvaluateAll() const {
+    // Формулы, которые нужно вычислить, по столбцам сверху вниз: их находят
+    // по статусам теневых столбцов, не обходя ячейки. Столбцы обходятся
+    // слева направо, поэтому блок, ссылающийся на блок левее, получает уже
+    // вычисленные аргументы
+    std::vector<Position> stale;
+    shadow_.ForEachStale([&stale](Position pos) {
+        stale.push_back(pos);
+    });
+    std::vector<std::pair<Position, const Cell*>> formulas;
+    for (Position pos : stale) {
+        const Cell* cell = GetConcreteCell(pos);
+        if (cell->GetProgram() && cell->NeedsEvaluation()) {
+            formulas.emplace_back(pos, cell);
+        } else {
+            // Кэш формулы уже действителен или формула не ссылается на
+            // другие ячейки: такую формулу достаточно прочитать
+            cell->GetValueView();
+            SyncShadow(pos);
+        }
+    }
+
+    std::vector<const Cell*> block;
+    for (std::size_t begin = 0; begin < formulas.size();) {
+        const auto [first, first_cell] = formulas[begin];
+        ColumnKernel kernel(*first_cell->GetProgram(), first);
+
+        block.assign(1, first_cell);
+        std::size_t end = begin + 1;
+        while (end < formulas.size()) {
+            const auto [pos, cell] = formulas[end];
+            if (pos.col != first.col || pos.row != first.row + static_cast<int>(block.size())
+                || !kernel.Matches(*cell->GetProgram(), pos)) {
+                break;
+            }
+            block.push_back(cell);
+            ++end;
+        }
+
+        // Формулы блока, ссылающиеся на свой столбец (=A1+1 в A2), зависят
+        // друг от друга, и вычислить их одновременно нельзя
+        const auto& offsets = kernel.GetInputOffsets();
+        const bool independent = std::none_of(offsets.begin(), offsets.end(), [](Position offset) {
+            return offset.col == 0;
+        });
+        if (block.size() >= MIN_KERNEL_BLOCK && independent) {
+            EvaluateBlock(kernel, first, block);
+        }
+        begin = end;
+    }
+
+    // Остальные формулы (и блоки, которые не удалось вычислить векторно).
+    // SyncShadow не вычисляет формулу, поэтому значение читается до него
+    for (const auto& [pos, cell] : formulas) {
+        if (shadow_.GetStatus(pos) == ShadowStatus::Stale) {
+            cell->GetValueView();
+            SyncShadow(pos);
+        }
+    }
+}
+
+namespace {
+ColumnKernel::ErrorCode ToKernelError(ShadowStatus status) {
+    switch (status) {
+        case ShadowStatus::Text:
+        case ShadowStatus::ValueError:
+            return ColumnKernel::ToErrorCode(FormulaError::Category::Value);
+        case ShadowStatus::RefError:
+            return ColumnKernel::ToErrorCode(FormulaError::Category::Ref);
+        case ShadowStatus::ArithmeticError:
+            return ColumnKernel::ToErrorCode(FormulaError::Category::Arithmetic);
+        default:
+            return ColumnKernel::NO_ERROR;
+    }
+}
+}  // namespace
+
+void Sheet::EvaluateBlock(const ColumnKernel& kernel, Position first,
+                          const std::vector<const Cell*>& block) const {
+    const std::vector<Position>& offsets = kernel.GetInputOffsets();
+    const std::size_t count = block.size();
+
+    // Аргументы формул блока читаются из теневых столбцов в непрерывные
+    // массивы, по одному на ссылку
+    std::vector<double> input_values(offsets.size() * count);
+    std::vector<ColumnKernel::ErrorCode> input_error_codes(offsets.size() * count);
+    std::vector<ShadowStatus> statuses(count);
+    std::vector<const double*> inputs;
+    std::vector<const ColumnKernel::ErrorCode*> input_errors;
+    for (std::size_t k = 0; k < offsets.size(); ++k) {
+        double* values = input_values.data() + k * count;
+        ColumnKernel::ErrorCode* errors = input_error_codes.data() + k * count;
+        ReadColumn({first.row + offsets[k].row, first.col + offsets[k].col}, count, values,
+                   statuses.data());
+        std::transform(statuses.begin(), statuses.end(), errors, ToKernelError);
+        inputs.push_back(values);
+        input_errors.push_back(errors);
+    }
+
+    std::vector<double> values(count);
+    std::vector<ColumnKernel::ErrorCode> errors(count);
+    kernel.Execute(inputs, input_errors, count, values.data(), errors.data());
+
+    const bool epoch_mode = recalculation_mode_ == RecalculationMode::Epoch;
+    for (std::size_t i = 0; i < count; ++i) {
+        const Position pos{first.row + static_cast<int>(i), first.col};
+        if (errors[i] == ColumnKernel::NO_ERROR) {
+            block[i]->StoreValue(CellValue::Number(values[i]));
+            if (!epoch_mode) {
+                shadow_.Set(pos, ShadowStatus::Number, values[i]);
+            }
+        } else {
+            const FormulaError error = ColumnKernel::ToFormulaError(errors[i]);
+            block[i]->StoreValue(CellValue::Error(error));
+            if (!epoch_mode) {
+                shadow_.Set(pos, ShadowColumns::Classify(error, false).first);
             }
         }
-        output << "\n";
+    }
+}
+
+void Sheet::ReadColumn(Position first, std::size_t count, double* values,
+                       ShadowStatus* statuses, std::string_view* texts) const {
+    ValidatePosition(first);
+    if (count > static_cast<std::size_t>(Position::MAX_ROWS - first.row)) {
+        throw InvalidPositionException("Column range goes beyond the sheet");
+    }
+
+    shadow_.Read(first, count, values, statuses, texts);
+
+    // Вычислить формулы, значения которых в теневых столбцах устарели
+    for (std::size_t i = 0; i < count; ++i) {
+        if (statuses[i] != ShadowStatus::Stale) {
+            continue;
+        }
+        const Position pos{first.row + static_cast<int>(i), first.col};
+        const Cell* cell = GetConcreteCell(pos);
+        assert(cell);
+        std::tie(statuses[i], values[i]) = ShadowColumns::Classify(cell->GetValueView(), false);
+        if (recalculation_mode_ != RecalculationMode::Epoch) {
+            shadow_.Set(pos, statuses[i], values[i]);
+        }
+    }
+}
+
+void Sheet::GetValues(Range range, double* numbers, ShadowStatus* statuses,
+                      std::string_view* strings) const {
+    ValidateRange(range);
+    const auto rows = static_cast<std::size_t>(range.size.rows);
+    const auto cols = static_cast<std::size_t>(range.size.cols);
+    if (cols == 1) {
+        ReadColumn(range.top_left, rows, numbers, statuses, strings);
+        return;
+    }
+
+    // Значения читаются по столбцам из теневых столбцов (устаревшие формулы
+    // вычисляет ReadColumn) и переставляются построчно
+    std::vector<double> column_numbers(rows);
+    std::vector<ShadowStatus> column_statuses(rows);
+    std::vector<std::string_view> column_strings(strings ? rows : 0);
+    for (std::size_t c = 0; c < cols; ++c) {
+        ReadColumn({range.top_left.row, range.top_left.col + static_cast<int>(c)}, rows,
+                   column_numbers.data(), column_statuses.data(),
+                   strings ? column_strings.data() : nullptr);
+        for (std::size_t r = 0; r < rows; ++r) {
+            numbers[r * cols + c] = column_numbers[r];
+            statuses[r * cols + c] = column_statuses[r];
+        }
+        if (strings) {
+            for (std::size_t r = 0; r < rows; ++r) {
+                strings[r * cols + c] = column_strings[r];
+            }
+        }
+    }
+}
+
+void Sheet::SyncShadow(Position pos) const {
+    const Cell* cell = GetConcreteCell(pos);
+    if (!cell || cell->IsEmpty()) {
+        shadow_.Set(pos, ShadowStatus::Empty);
+        return;
+    }
+
+    // В режиме Epoch значение формулы может устареть без обхода зависимых,
+    // поэтому в теневых столбцах оно всегда считается устаревшим
+    const bool formula = cell->GetProgram() != nullptr;
+    if (formula
+        && (recalculation_mode_ == RecalculationMode::Epoch || cell->NeedsEvaluation())) {
+        shadow_.Set(pos, ShadowStatus::Stale);
+        return;
+    }
+    const Cell::ValueView view = cell->GetValueView();
+    auto [status, value] = ShadowColumns::Classify(view, !formula);
+    shadow_.Set(pos, status, value,
+                formula ? std::string_view() : std::get<std::string_view>(view));
+}
+
+Size Sheet::GetPrintableSize() const {
+    if (non_empty_rows_.empty()) {
+        return {0, 0};
+    }
+    return {non_empty_rows_.rbegin()->first + 1, non_empty_cols_.rbegin()->first + 1};
+}
+
+template <typename Printer>
+void Sheet::PrintRows(std::ostream& output, int first_row, int last_row, int cols,
+                      Printer print) const {
+    // Вывести разделители за пропущенные пустые позиции: column - столбец,
+    // до которого уже выведены разделители в текущей строке
+    int row = first_row;
+    int column = 0;
+    auto finish_row = [&]() {
+        for (; column + 1 < cols; ++column) {
+            output << '\t';
+        }
+        output << '\n';
+        column = 0;
+        ++row;
+    };
+
+    ForEachCellInRange({{first_row, 0}, {last_row - first_row, cols}},
+                       [&](Position pos, const Cell& cell) {
+        while (row < pos.row) {
+            finish_row();
+        }
+        for (; column < pos.col; ++column) {
+            output << '\t';
+        }
+        print(output, cell);
+    });
+    while (row < last_row) {
+        finish_row();
+    }
+}
+
+template <typename Printer>
+void Sheet::PrintCells(std::ostream& output, Printer print) const {
+    Size size = GetPrintableSize();
+    PrintRows(output, 0, size.rows, size.cols, print);
+}
+
+namespace {
+// Наименьшее число непустых строк в отрезке параллельного вывода: меньшие
+// отрезки не окупают отдельный буфер
+const std::size_t MIN_EXPORT_CHUNK_ROWS = 1024;
+
+// Число отрезков на поток: позволяет потокам выравнивать нагрузку, если
+// строки отрезков различаются по длине
+const std::size_t EXPORT_CHUNKS_PER_THREAD = 4;
+}  // namespace
+
+template <typename Printer>
+void Sheet::PrintCellsParallel(std::ostream& output, unsigned threads, Printer print) const {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    Size size = GetPrintableSize();
+
+    // Границы отрезков строк с примерно равным числом непустых строк
+    std::vector<int> bounds{0};
+    const std::size_t chunk_count = std::min<std::size_t>(
+        threads * EXPORT_CHUNKS_PER_THREAD, non_empty_rows_.size() / MIN_EXPORT_CHUNK_ROWS);
+    if (threads > 1 && chunk_count > 1) {
+        const std::size_t chunk_rows = (non_empty_rows_.size() + chunk_count - 1) / chunk_count;
+        std::size_t index = 0;
+        for (const auto& [row, occupancy] : non_empty_rows_) {
+            if (index > 0 && index % chunk_rows == 0) {
+                bounds.push_back(row);
+            }
+            ++index;
+        }
+    }
+    bounds.push_back(size.rows);
+    const std::size_t chunks = bounds.size() - 1;
+    if (chunks < 2) {
+        PrintCells(output, print);
+        return;
+    }
+
+    // Потоки берут отрезки по порядку и форматируют каждый в свой буфер с
+    // форматом вывода output, а вызывающий поток выводит готовые буферы по
+    // порядку, не дожидаясь остальных
+    std::vector<std::promise<std::string>> results(chunks);
+    std::vector<std::future<std::string>> pending;
+    for (auto& result : results) {
+        pending.push_back(result.get_future());
+    }
+    std::atomic<std::size_t> next_chunk{0};
+    auto work = [&]() {
+        for (std::size_t chunk; (chunk = next_chunk++) < chunks;) {
+            try {
+                std::ostringstream buffer;
+                buffer.copyfmt(output);
+                if (chunk > 0) {
+                    // Ширина поля действует только на первый вывод
+                    buffer.width(0);
+                }
+                PrintRows(buffer, bounds[chunk], bounds[chunk + 1], size.cols, print);
+                results[chunk].set_value(std::move(buffer).str());
+            } catch (...) {
+                results[chunk].set_exception(std::current_exception());
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::min<std::size_t>(threads, chunks); ++i) {
+        workers.emplace_back(work);
+    }
+    std::exception_ptr error;
+    for (auto& chunk : pending) {
+        try {
+            const std::string text = chunk.get();
+            if (!error) {
+                output.write(text.data(), static_cast<std::streamsize>(text.size()));
+            }
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    output.width(0);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintCells(output, [this](std::ostream& output, const Cell& cell) {
+        PrintValue(output, cell);
+    });
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [](std::ostream& output, const Cell& cell) {
+        output << cell.GetText();
+    });
+}
+
+FrozenSheet Sheet::Freeze() const {
+    EvaluateAll();
+    FrozenSheet::Builder builder;
+    ForEachCell([&builder](Position pos, const Cell& cell) {
+        builder.AddCell(pos, cell.GetCachedValue(), cell.GetText());
+    });
+    return builder.Build(GetPrintableSize(), number_format_);
+}
+
+void Sheet::PrintValuesParallel(std::ostream& output, unsigned threads) const {
+    // Все формулы вычисляются заранее в порядке зависимостей, и кэш каждой
+    // непустой ячейки после этого действителен (в режиме Epoch - проверен на
+    // текущей правке). Потоки только читают кэш и ничего в ячейках не пишут
+    EvaluateAll();
+    PrintCellsParallel(output, threads, [this](std::ostream& output, const Cell& cell) {
+        assert(cell.IsCacheValid());
+        PrintValue(output, cell);
+    });
+}
+
+void Sheet::PrintTextsParallel(std::ostream& output, unsigned threads) const {
+    PrintCellsParallel(output, threads, [](std::ostream& output, const Cell& cell) {
+        output << cell.GetText();
+    });
+}
+
+void Sheet::PrintValue(std::ostream& output, const Cell& cell) const {
+    Cell::ValueView value = cell.GetValueView();
+    if (std::holds_alternative<double>(value)) {
+        WriteNumber(output, std::get<double>(value), number_format_);
+    } else {
+        std::visit([&output](const auto &elem) { output << elem; }, value);
     }
 }
 
@@ -304,17 +1421,191 @@ void Sheet::ValidatePosition(Position pos) {
     }
 }
 
-void Sheet::PlaceCell(Position pos, std::unique_ptr<Cell> cell) {
-    if (pos.row >= static_cast<int>(cells_.size())) {
-        cells_.resize(pos.row + 1);
+void Sheet::ValidateRange(Range range) {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid range: "s + range.top_left.ToString()
+            + ", rows = "s + std::to_string(range.size.rows)
+            + ", cols = "s + std::to_string(range.size.cols));
     }
-    std::vector<std::unique_ptr<Cell>>& row = cells_[pos.row];
-    if (pos.col >= static_cast<int>(row.size())) {
-        row.resize(pos.col + 1);
+}
+
+void Sheet::ClearCells(const std::vector<Position>& poses) {
+    ++epoch_;
+    if (undo_limit_ > 0) {
+        HistoryEntry entry;
+        entry.cells.reserve(poses.size());
+        for (Position pos : poses) {
+            entry.Add(pos, GetConcreteCell(pos));
+        }
+        RecordUndo(std::move(entry));
     }
-    row[pos.col] = std::move(cell);
-    printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
-    printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
+
+    // Удалить исходящие зависимости всех очищаемых ячеек. После этого у
+    // очищаемой ячейки остаются только зависимые вне очищаемого множества
+    std::vector<Position> in_graph;
+    for (Position pos : poses) {
+        if (graph_->Contains(pos)) {
+            graph_->RemoveDependencies(pos);
+            in_graph.push_back(pos);
+        }
+    }
+
+    // Сбросить кэш ровно у множества зависимых ячеек
+    if (recalculation_mode_ == RecalculationMode::Lazy) {
+        InvalidateDependents(in_graph);
+    }
+
+    for (Position pos : poses) {
+        Cell* cell = GetConcreteCell(pos);
+        if (!cell) {
+            // Пустая ячейка уже удалена как заглушка, на которую ссылалась
+            // другая очищаемая ячейка
+            continue;
+        }
+
+        // Удалить ячейки-заглушки, потерявшие последнюю зависимую ячейку
+        for (Position next : cell->GetReferencedCellsView()) {
+            ReclaimIfOrphan(next);
+        }
+
+        if (graph_->HasDependents(pos)) {
+            // На ячейку ссылаются формулы: оставить пустую ячейку-заглушку
+            if (!cell->IsEmpty()) {
+                MarkNonEmpty(pos, false);
+            }
+            cell->Clear();
+            cells_.MarkChanged(pos);
+            SyncShadow(pos);
+        } else {
+            graph_->RemoveCell(pos);
+            RemoveCell(pos);
+        }
+    }
+
+    if (recalculation_mode_ == RecalculationMode::Eager) {
+        // Пересчитать зависимые от оставшихся ячеек-заглушек
+        std::vector<Position> changed;
+        for (Position pos : in_graph) {
+            if (graph_->HasDependents(pos)) {
+                changed.push_back(pos);
+            }
+        }
+        PropagateChanges(changed);
+    }
+}
+
+void Sheet::ReclaimIfOrphan(Position pos) {
+    if (graph_->HasDependents(pos)) {
+        return;
+    }
+    graph_->RemoveCellIfIsolated(pos);
+    const Cell* cell = GetConcreteCell(pos);
+    if (cell && cell->IsEmpty()) {
+        RemoveCell(pos);
+    }
+}
+
+void Sheet::InvalidateDependents(const std::vector<Position>& poses) {
+    // callback функция для сброса кэша ячейки
+    std::function<void(Position)> reseter
+        = [this](Position pos) {
+            const Cell* cell_ = this->GetConcreteCell(pos);
+            assert(cell_);
+            cell_->ResetCache();
+            shadow_.Set(pos, ShadowStatus::Stale);
+        };
+
+    graph_->ResetCache(poses, reseter);
+}
+
+void Sheet::PropagateChanges(const std::vector<Position>& changed_poses) {
+    std::unordered_set<PositionKey> changed;
+    for (Position pos : changed_poses) {
+        changed.insert(ToKey(pos));
+    }
+
+    for (Position pos : graph_->GetTopologicalOrder(changed_poses)) {
+        if (changed.count(ToKey(pos))) {
+            continue;
+        }
+        const Cell* cell = GetConcreteCell(pos);
+        assert(cell);
+
+        // Пересчитать ячейку, только если изменился хотя бы один её аргумент
+        PositionSpan refs = cell->GetReferencedCellsView();
+        bool affected = std::any_of(refs.begin(), refs.end(), [&changed](Position ref) {
+            return changed.count(ToKey(ref)) > 0;
+        });
+        if (!affected) {
+            continue;
+        }
+        if (cell->Recalculate()) {
+            changed.insert(ToKey(pos));
+        }
+        SyncShadow(pos);
+    }
+}
+
+std::unique_ptr<Cell> Sheet::RemoveCell(Position pos) {
+    std::unique_ptr<Cell> cell = cells_.Extract(pos);
+    if (cell != nullptr && !cell->IsEmpty()) {
+        MarkNonEmpty(pos, false);
+    }
+    shadow_.Set(pos, ShadowStatus::Empty);
+    return cell;
+}
+
+std::unique_ptr<Cell> Sheet::PlaceCell(Position pos, std::unique_ptr<Cell> cell) {
+    bool non_empty = !cell->IsEmpty();
+    std::unique_ptr<Cell> old_cell = cells_.Place(pos, std::move(cell));
+    bool was_non_empty = old_cell != nullptr && !old_cell->IsEmpty();
+    if (non_empty != was_non_empty) {
+        MarkNonEmpty(pos, non_empty);
+    }
+    SyncShadow(pos);
+    return old_cell;
+}
+
+void Sheet::MarkNonEmpty(Position pos, bool non_empty) {
+    int& col_count = non_empty_cols_[pos.col];
+    if (non_empty) {
+        non_empty_rows_[pos.row].Set(pos.col);
+        ++col_count;
+    } else {
+        auto row_it = non_empty_rows_.find(pos.row);
+        assert(row_it != non_empty_rows_.end());
+        row_it->second.Reset(pos.col);
+        if (row_it->second.IsEmpty()) {
+            non_empty_rows_.erase(row_it);
+        }
+        assert(col_count > 0);
+        --col_count;
+    }
+    if (col_count == 0) {
+        non_empty_cols_.erase(pos.col);
+    }
+}
+
+void Sheet::RowOccupancy::Set(int col) {
+    auto it = std::lower_bound(words.begin(), words.end(), std::make_pair(col / 64, std::uint64_t{0}));
+    if (it == words.end() || it->first != col / 64) {
+        it = words.insert(it, {col / 64, 0});
+    }
+    it->second |= std::uint64_t{1} << (col % 64);
+}
+
+void Sheet::RowOccupancy::Reset(int col) {
+    auto it = std::lower_bound(words.begin(), words.end(), std::make_pair(col / 64, std::uint64_t{0}));
+    if (it != words.end() && it->first == col / 64) {
+        it->second &= ~(std::uint64_t{1} << (col % 64));
+        if (it->second == 0) {
+            words.erase(it);
+        }
+    }
+}
+
+bool Sheet::RowOccupancy::IsEmpty() const {
+    return words.empty();
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,14 +1,72 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "frozen_sheet.h"
+#include "number_format.h"
+#include "shadow_columns.h"
+#include "string_pool.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <map>
 #include <memory>
+#include <string_view>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+class ColumnKernel;
 class DependencyGraph;
+class ReplicationLog;
+
+// Способ поддержания актуальности кэшированных значений после изменений
+enum class RecalculationMode {
+    // Сбросить кэш всех зависимых ячеек, значения вычисляются при чтении
+    Lazy,
+    // Сразу пересчитать зависимые ячейки в топологическом порядке. Если
+    // значение ячейки не изменилось, её зависимые не пересчитываются
+    Eager,
+    // Не обходить зависимые ячейки при изменении. Каждое изменение получает
+    // новый номер правки, а кэш ячейки помечен правкой, на которой он
+    // проверен. При чтении кэш проверяется по меткам аргументов: изменение
+    // стоит O(1), стоимость проверки переносится на чтение
+    Epoch,
+};
+
+// Изменение текста ячейки. Пустой текст - пустая или отсутствующая ячейка
+struct CellChange {
+    Position pos;
+    std::string old_text;
+    std::string new_text;
+};
+
+// Ячейка, изменённая по-разному в обеих сливаемых версиях таблицы
+struct MergeConflict {
+    Position pos;
+    std::string base_text;
+    std::string our_text;
+    std::string their_text;
+};
+
+// Содержимое ячейки в разобранном виде: формула задаётся программой (см.
+// MakeFormula), остальные ячейки - текстом
+struct CompiledCell {
+    Position pos;
+    // Программа формулы; пустая, если ячейка не формула
+    FormulaProgram program;
+    std::string text;
+};
+
+struct MergeResult {
+    // Изменения, применённые к таблице
+    std::vector<CellChange> applied;
+    // Конфликтующие ячейки; таблица в них не изменяется
+    std::vector<MergeConflict> conflicts;
+};
 
 class Sheet : public SheetInterface {
 public:
@@ -25,16 +83,288 @@ public:
 
     void ClearCell(Position pos) override;
 
+    // Очищает все ячейки прямоугольной области за один проход: удаляет их
+    // зависимости с графа и однократно сбрасывает кэш зависимых ячеек.
+    // Бросает InvalidPositionException, если область выходит за пределы
+    // таблицы.
+    void ClearRange(Range range);
+
+    // Задаёт тексты нескольких ячеек одним изменением: все формулы
+    // разбираются до изменения таблицы, циклические зависимости проверяются
+    // одним обходом графа, кэш зависимых ячеек сбрасывается один раз. Пустой
+    // текст очищает ячейку. Бросает те же исключения, что SetCell, а также
+    // InvalidPositionException при повторе позиции; при исключении таблица
+    // не изменяется.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // То же, что SetCells, но формулы задаются программами и не разбираются.
+    // Если keep_empty_cells, ячейки с пустым текстом остаются в таблице
+    // пустыми, как после SetCell (так реплика повторяет SetCell ведущей
+    // таблицы)
+    void SetCompiledCells(std::vector<CompiledCell> cells, bool keep_empty_cells = false);
+
+    // Копирует ячейки области source в область того же размера с левым
+    // верхним углом destination одним изменением, как SetCompiledCells.
+    // Программы формул копируются без разбора текста, ссылки сдвигаются на
+    // смещение областей; ссылки, вышедшие за пределы таблицы, становятся
+    // ошибкой #REF!. Пустые ячейки источника очищают соответствующие ячейки
+    // назначения. Области могут перекрываться. Бросает
+    // InvalidPositionException, если область выходит за пределы таблицы, и
+    // CircularDependencyException; при исключении таблица не изменяется.
+    void CopyRange(Range source, Position destination);
+
+    // История изменений ячеек для отмены: хранит не больше limit последних
+    // изменений (SetCell, ClearCell, ClearRange, SetCells, SetCompiledCells,
+    // Merge). Запись истории - прежнее содержимое изменённых ячеек в
+    // разобранном виде, её размер пропорционален изменению. По умолчанию
+    // limit = 0: история не ведётся.
+    void SetUndoLimit(std::size_t limit);
+
+    // Отменяет последнее изменение из истории или повторяет последнее
+    // отменённое одним пакетным изменением без разбора формул. Кэш
+    // сбрасывается только у зависимых от восстановленных ячеек. Новое
+    // изменение очищает список отменённых. Возвращают false, если отменять
+    // (повторять) нечего.
+    bool Undo();
+    bool Redo();
+    bool CanUndo() const;
+    bool CanRedo() const;
+
+    // Изменения текстов, превращающие эту таблицу в other, в порядке строк.
+    // Сравниваются хеши блоков 8x8 ячеек (см.
+    // CellStorage::ForEachDifferentBlock), поячеечно - только блоки с
+    // разными хешами.
+    std::vector<CellChange> Diff(const Sheet& other) const;
+
+    // Трёхстороннее слияние: применяет к этой таблице изменения theirs
+    // относительно base, кроме ячеек, изменённых здесь относительно base
+    // иначе. Ячейки, изменённые одинаково, пропускаются, изменённые по-разному
+    // возвращаются как конфликты. Изменения применяются одним вызовом
+    // SetCells, поэтому при исключении таблица не изменяется.
+    MergeResult Merge(const Sheet& base, const Sheet& theirs);
+
+    // Вставляют count пустых строк (столбцов) перед строкой (столбцом) before
+    // и удаляют count строк (столбцов), начиная с first. Ячейки за ними
+    // сдвигаются, ссылки формул переписываются на месте без разбора текста;
+    // ссылки на удалённые ячейки становятся ошибкой #REF!. Обрабатываются
+    // только сдвигаемые ячейки и формулы, ссылающиеся на них; кэш
+    // сбрасывается только у формул, потерявших ссылку, и их зависимых.
+    // История отмены очищается. Бросают InvalidPositionException, если
+    // строки (столбцы) выходят за пределы таблицы или вставка сдвинула бы
+    // непустые ячейки за её пределы; в этом случае таблица не изменяется.
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Удаляет пустые ячейки, на которые не ссылается ни одна формула,
+    // неиспользуемые узлы графа зависимостей и освобождает лишнюю память
+    // хранилища ячеек.
+    void Compact();
+
     Size GetPrintableSize() const override;
 
+    // По умолчанию используется RecalculationMode::Lazy
+    void SetRecalculationMode(RecalculationMode mode);
+    RecalculationMode GetRecalculationMode() const;
+
+    // Формат чисел в PrintValues. По умолчанию используется
+    // NumberFormat::Shortest
+    void SetNumberFormat(NumberFormat format);
+    NumberFormat GetNumberFormat() const;
+
+    // Подключает журнал репликации (nullptr - отключает): после подключения
+    // таблица записывает в него свои изменения, см. ReplicationLog. Журнал
+    // должен жить, пока подключён
+    void SetReplicationLog(ReplicationLog* log);
+
+    // Номер текущей правки таблицы: увеличивается при каждом изменении
+    // ячеек.
+    std::uint64_t GetEpoch() const;
+
+    // Пул строк текстовых ячеек листа. Изменяется и у константного листа:
+    // строки пула не являются частью значения таблицы
+    StringPool& GetStringPool() const;
+
+    // Вычисляет все формулы, значения которых нужно пересчитать. Блоки
+    // формул, протянутых вниз по столбцу, вычисляются векторно через
+    // ColumnKernel, остальные формулы - по одной.
+    void EvaluateAll() const;
+
+    // Значения отрезка столбца из first вниз на count строк в том виде, в
+    // котором их видят формулы: числа в values и статусы в statuses (кроме
+    // Stale: устаревшие формулы вычисляются), и, если texts не nullptr, текст
+    // текстовых ячеек. Читает теневые столбцы, а не ячейки. Бросает
+    // InvalidPositionException, если отрезок выходит за пределы таблицы.
+    void ReadColumn(Position first, std::size_t count, double* values,
+                    ShadowStatus* statuses, std::string_view* texts = nullptr) const;
+
+    // Значения прямоугольной области в массивах вызывающего, построчно:
+    // ячейке (r, c) области соответствует элемент r * range.size.cols + c.
+    // В numbers и statuses - значения в том виде, в котором их видят формулы
+    // (статус Stale не возвращается), в strings - текст текстовых ячеек (для
+    // остальных - пустая строка; strings может быть nullptr). Строки
+    // действительны до следующего изменения таблицы. Формулы области, которые
+    // нужно вычислить, вычисляются в порядке зависимостей. Бросает
+    // InvalidPositionException, если область выходит за пределы таблицы.
+    void GetValues(Range range, double* numbers, ShadowStatus* statuses,
+                   std::string_view* strings) const;
+
+    // Обходит непустые ячейки таблицы (или области) в порядке строк, не
+    // перебирая пустые позиции. Функция вызывается с аргументами
+    // (Position, const Cell&). Изменять таблицу во время обхода нельзя.
+    template <typename Func>
+    void ForEachCell(Func func) const;
+    template <typename Func>
+    void ForEachCellInRange(Range range, Func func) const;
+
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Вычисляет все формулы и возвращает неизменяемую копию значений и
+    // текстов таблицы для чтения, см. FrozenSheet. Последующие изменения
+    // таблицы на копию не влияют
+    FrozenSheet Freeze() const;
+
+    // Параллельный вывод: область печати делится на отрезки строк, потоки
+    // форматируют отрезки в отдельные буферы, и буферы выводятся по порядку.
+    // Результат совпадает с PrintValues/PrintTexts побайтно. threads = 0 -
+    // по числу ядер процессора. Формулы перед выводом вычисляются через
+    // EvaluateAll
+    void PrintValuesParallel(std::ostream& output, unsigned threads = 0) const;
+    void PrintTextsParallel(std::ostream& output, unsigned threads = 0) const;
+
 private:
     std::unique_ptr<DependencyGraph> graph_;
-	std::vector<std::vector<std::unique_ptr<Cell>>> cells_;
-    Size printable_size_;
+    RecalculationMode recalculation_mode_ = RecalculationMode::Lazy;
+    std::uint64_t epoch_ = 0;
+    NumberFormat number_format_ = NumberFormat::Shortest;
+    ReplicationLog* replication_log_ = nullptr;
+
+    // Запись истории: прежнее содержимое ячеек и позиции, в которых ячеек
+    // не было. Пустые ячейки восстанавливаются, как после SetCell, а в
+    // позициях absent - удаляются, если на них никто не ссылается
+    struct HistoryEntry {
+        std::vector<CompiledCell> cells;
+        std::vector<Position> absent;
+
+        void Add(Position pos, const Cell* cell);
+    };
+
+    // Записи истории для каждого изменения, см. SetUndoLimit
+    std::size_t undo_limit_ = 0;
+    std::deque<HistoryEntry> undo_;
+    std::deque<HistoryEntry> redo_;
+
+    // Объявлен до ячеек: текстовые ячейки отпускают свои строки при
+    // уничтожении
+    mutable StringPool strings_;
+    CellStorage cells_;
+
+    // Значения ячеек по столбцам, см. ShadowColumns. Обновляются при
+    // изменении ячеек и пересчёте; формулы, вычисленные при чтении через
+    // GetValue, остаются Stale до EvaluateAll или ReadColumn
+    mutable ShadowColumns shadow_;
+
+    // Битовая карта непустых ячеек строки: 64-битные слова масок столбцов,
+    // упорядоченные по номеру слова. Хранятся только ненулевые слова
+    struct RowOccupancy {
+        std::vector<std::pair<int, std::uint64_t>> words;
+
+        void Set(int col);
+        void Reset(int col);
+        bool IsEmpty() const;
+
+        static int LowestBit(std::uint64_t bits) {
+#if defined(__GNUC__)
+            return __builtin_ctzll(bits);
+#else
+            int bit = 0;
+            while (!(bits & (std::uint64_t{1} << bit))) {
+                ++bit;
+            }
+            return bit;
+#endif
+        }
+    };
+
+    // Непустые ячейки по строкам и число непустых ячеек в каждом столбце.
+    // По ним определяется печатная область и выполняется обход ячеек
+    std::map<int, RowOccupancy> non_empty_rows_;
+    std::map<int, int> non_empty_cols_;
 
     static void ValidatePosition(Position pos);
-    void PlaceCell(Position pos, std::unique_ptr<Cell> cell);
-};
\ No newline at end of file
+    static void ValidateRange(Range range);
+    void ClearCells(const std::vector<Position>& poses);
+    // Если keep_empty_cells, пустые ячейки остаются в таблице, кроме позиций
+    // reclaimed
+    void PlaceCells(std::vector<std::pair<Position, std::unique_ptr<Cell>>> cells,
+                    bool record_undo = true, bool keep_empty_cells = false,
+                    const std::vector<Position>& reclaimed = {});
+    std::vector<std::pair<Position, std::unique_ptr<Cell>>> BuildCells(
+        std::vector<CompiledCell> cells);
+    static CompiledCell ToCompiledCell(Position pos, const Cell* cell);
+    void RecordUndo(HistoryEntry entry);
+    bool ApplyHistory(std::deque<HistoryEntry>& from, std::deque<HistoryEntry>& to);
+    void ShiftLines(int Position::*axis, int first, int count, bool insert);
+    void InvalidateDependents(const std::vector<Position>& poses);
+    void PropagateChanges(const std::vector<Position>& changed_poses);
+    void ReclaimIfOrphan(Position pos);
+    std::unique_ptr<Cell> RemoveCell(Position pos);
+    std::unique_ptr<Cell> PlaceCell(Position pos, std::unique_ptr<Cell> cell);
+    void MarkNonEmpty(Position pos, bool non_empty);
+    void SyncShadow(Position pos) const;
+    void EvaluateBlock(const ColumnKernel& kernel, Position first,
+                       const std::vector<const Cell*>& block) const;
+
+    void PrintValue(std::ostream& output, const Cell& cell) const;
+
+    // Выводит строки [first_row, last_row) шириной cols столбцов. Функция
+    // print вызывается с аргументами (std::ostream&, const Cell&)
+    template <typename Printer>
+    void PrintRows(std::ostream& output, int first_row, int last_row, int cols,
+                   Printer print) const;
+    template <typename Printer>
+    void PrintCells(std::ostream& output, Printer print) const;
+    template <typename Printer>
+    void PrintCellsParallel(std::ostream& output, unsigned threads, Printer print) const;
+};
+
+template <typename Func>
+void Sheet::ForEachCell(Func func) const {
+    ForEachCellInRange({{0, 0}, {Position::MAX_ROWS, Position::MAX_COLS}}, std::move(func));
+}
+
+template <typename Func>
+void Sheet::ForEachCellInRange(Range range, Func func) const {
+    const int row_end = range.top_left.row + range.size.rows;
+    const int col_begin = range.top_left.col;
+    const int col_end = range.top_left.col + range.size.cols;
+    if (range.size.cols <= 0) {
+        return;
+    }
+
+    for (auto row_it = non_empty_rows_.lower_bound(range.top_left.row);
+         row_it != non_empty_rows_.end() && row_it->first < row_end; ++row_it) {
+        const auto& words = row_it->second.words;
+        auto word_it = std::lower_bound(words.begin(), words.end(),
+                                        std::make_pair(col_begin / 64, std::uint64_t{0}));
+        for (; word_it != words.end() && word_it->first * 64 < col_end; ++word_it) {
+            std::uint64_t bits = word_it->second;
+            while (bits != 0) {
+                int bit = RowOccupancy::LowestBit(bits);
+                bits &= bits - 1;
+
+                int col = word_it->first * 64 + bit;
+                if (col < col_begin) {
+                    continue;
+                }
+                if (col >= col_end) {
+                    break;
+                }
+                Position pos{row_it->first, col};
+                func(pos, *GetConcreteCell(pos));
+            }
+        }
+    }
+}
\ No newline at end of file
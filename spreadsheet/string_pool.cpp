@@ -0,0 +1,46 @@
+#include "string_pool.h"
+
+#include <cassert>
+
+StringPool::Id StringPool::Acquire(std::string_view str) {
+    auto it = ids_.find(str);
+    if (it != ids_.end()) {
+        ++entries_[it->second].refs;
+        return it->second;
+    }
+
+    Id id;
+    if (!free_ids_.empty()) {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    } else {
+        id = static_cast<Id>(entries_.size());
+        entries_.emplace_back();
+    }
+    Entry& entry = entries_[id];
+    entry.text.assign(str);
+    entry.refs = 1;
+    ids_.emplace(entry.text, id);
+    return id;
+}
+
+void StringPool::Release(Id id) {
+    Entry& entry = entries_[id];
+    assert(entry.refs > 0);
+    if (--entry.refs > 0) {
+        return;
+    }
+    ids_.erase(entry.text);
+    // Освободить память строки, а не только очистить её
+    std::string().swap(entry.text);
+    free_ids_.push_back(id);
+}
+
+const std::string& StringPool::Get(Id id) const {
+    assert(entries_[id].refs > 0);
+    return entries_[id].text;
+}
+
+std::size_t StringPool::Size() const {
+    return ids_.size();
+}
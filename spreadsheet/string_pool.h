@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Пул строк листа: каждая различная строка хранится один раз, а текстовые
+// ячейки держат её 4-байтовый идентификатор. Записи неизменяемые и
+// считают ссылки: запись освобождается, когда её отпускает последний
+// владелец, и её идентификатор используется повторно. Адрес строки записи
+// не меняется, пока она жива, поэтому на неё можно ссылаться из CellValue.
+class StringPool {
+public:
+    using Id = std::uint32_t;
+
+    // Возвращает идентификатор строки и увеличивает число ссылок на неё
+    Id Acquire(std::string_view str);
+
+    // Уменьшает число ссылок; запись без ссылок удаляется
+    void Release(Id id);
+
+    const std::string& Get(Id id) const;
+
+    // Число различных строк в пуле
+    std::size_t Size() const;
+
+private:
+    struct Entry {
+        std::string text;
+        std::uint32_t refs = 0;
+    };
+
+    // deque не перемещает элементы при добавлении, поэтому ключи ids_
+    // (представления строк записей) остаются действительными
+    std::deque<Entry> entries_;
+    std::vector<Id> free_ids_;
+    std::unordered_map<std::string_view, Id> ids_;
+};
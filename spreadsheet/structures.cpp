@@ -79,6 +79,21 @@ bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
 
+bool Range::operator==(Range rhs) const {
+    return top_left == rhs.top_left && size == rhs.size;
+}
+
+bool Range::IsValid() const {
+    return top_left.IsValid() && size.rows >= 0 && size.cols >= 0
+        && size.rows <= Position::MAX_ROWS - top_left.row
+        && size.cols <= Position::MAX_COLS - top_left.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= top_left.row && pos.row - top_left.row < size.rows
+        && pos.col >= top_left.col && pos.col - top_left.col < size.cols;
+}
+
 FormulaError::FormulaError(Category category)
 : category_(category) {
 }